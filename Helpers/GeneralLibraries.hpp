@@ -17,6 +17,9 @@
 #include <map>
 #include <chrono>
 #include <deque>
+#include <functional>
+#include <memory>
+#include <type_traits>
 
 #include <vulkan/vulkan_raii.hpp>
 
@@ -25,44 +28,90 @@
 #include <glm/gtc/matrix_transform.hpp>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/rotate_vector.hpp>
+#include <glm/gtc/packing.hpp>
 #include <glm/ext.hpp>
 
 #include "vk_mem_alloc.h"
 
+// Defined in VulkanEngine/memory.cpp, keeps the memory report in sync with the lifetime of buffers and images
+namespace MemoryAllocator{
+    void untrackAllocation(VmaAllocation allocation);
+}
 
 
 
+// Runtime configuration of the engine, filled from the command line
+struct EngineConfig{
+    int frames_in_flight = 2; // From 1 (lowest latency) to 4 (highest throughput)
+    vk::PresentModeKHR present_mode = vk::PresentModeKHR::eMailbox; // Preferred mode, Fifo is used when not supported
+    uint32_t swapchain_images = 3; // Requested image count, clamped to the surface limits
+    bool measure_latency = true; // Prints key press to present submission latency statistics
+    int worker_threads = -1; // Threads used for command recording, -1 picks one less than the available cores
+    bool async_compute = true; // Compute work goes to a dedicated family when available, false keeps it on the graphics queue
+    bool load_pipeline_cache = true; // false ignores the cache file to measure a cold start, the cache is still saved on exit
+    bool hot_reload = true; // Watches Shaders/ and rebuilds the pipelines using a modified shader
+    bool bench_transforms = false; // Compares the Gameobject and TransformStore update paths and exits without opening a window
+};
+
+// Command pool used by a single recording thread for a single frame in flight, with the secondary buffers allocated from it.
+// The whole pool is reset once the frame timeline value is waited, the buffers are then reused in order
+struct ThreadCommandPool{
+    vk::raii::CommandPool pool = nullptr;
+    std::vector<vk::raii::CommandBuffer> secondary_buffers;
+    uint32_t used = 0;
+};
+
+// Timeline semaphore of a queue. value is the last value reserved by a submission, the GPU increases the counter up to it
+struct Timeline{
+    vk::raii::Semaphore semaphore = nullptr;
+    uint64_t value = 0;
+};
+
 // Structure to hold queue family indices, the queues themselves and the relative command pool
 struct QueuePool {
     std::optional<uint32_t> graphics_family;
     std::optional<uint32_t> present_family;
     std::optional<uint32_t> transfer_family;
+    std::optional<uint32_t> compute_family;
+    bool prefer_async_compute = true; // Look for a compute family without graphics, so that compute overlaps the graphics queue
 
     vk::raii::Queue graphics_queue = nullptr;
     vk::raii::Queue transfer_queue = nullptr;
     vk::raii::Queue present_queue = nullptr;
+    vk::raii::Queue compute_queue = nullptr; // Same queue as graphics_queue when there is no dedicated family
 
     vk::raii::CommandPool graphics_command_pool = nullptr;
     vk::raii::CommandPool transfer_command_pool = nullptr;
+    vk::raii::CommandPool compute_command_pool = nullptr;
+
+    // Work submitted on each queue is tracked by monotonically increasing values
+    Timeline graphics_timeline;
+    Timeline transfer_timeline;
+    Timeline compute_timeline;
 
     vk::raii::CommandBuffers graphics_command_buffers = nullptr;
+    vk::raii::CommandBuffers compute_command_buffers = nullptr; // One per frame in flight
+    std::vector<std::vector<ThreadCommandPool>> thread_command_pools; // [frame][thread], thread 0 is the main thread
     int max_frames_in_flight = 2;
 
     bool isIndexComplete() const{
         return graphics_family.has_value() && 
             present_family.has_value() &&
-            transfer_family.has_value();
+            transfer_family.has_value() &&
+            compute_family.has_value();
     }
 
     bool isQueueComplete(){
         return graphics_queue != nullptr &&
             present_queue != nullptr &&
-            transfer_queue != nullptr;
+            transfer_queue != nullptr &&
+            compute_queue != nullptr;
     }
 
     bool isPoolComplete(){
         return graphics_command_pool != nullptr &&
-            transfer_command_pool != nullptr;
+            transfer_command_pool != nullptr &&
+            compute_command_pool != nullptr;
     }
 
 
@@ -116,6 +165,7 @@ struct AllocatedImage{
             if(image_view != nullptr){
                 image_view = nullptr;
             }
+            MemoryAllocator::untrackAllocation(allocation);
             vmaDestroyImage(allocator, image, allocation);
             image = nullptr;
             allocator = nullptr;
@@ -141,7 +191,10 @@ struct AllocatedImage{
         if (this != &other) {
             // Destroy current if it exists
             image_view = nullptr;
-            if (image && allocator) vmaDestroyImage(allocator, image, allocation);
+            if (image && allocator){
+                MemoryAllocator::untrackAllocation(allocation);
+                vmaDestroyImage(allocator, image, allocation);
+            }
             
             image = other.image;
             allocation = other.allocation;
@@ -180,16 +233,57 @@ struct AllocatedImage{
 };
 
 
+// Values of the specialization constants of a pipeline, shared by its stages. Ids a stage doesn't declare are ignored by it
+struct SpecializationConstants{
+    std::vector<vk::SpecializationMapEntry> entries;
+    std::vector<uint8_t> data;
+
+    // Appends a constant. Booleans have to be passed as vk::Bool32, the size of a GLSL bool constant
+    template<typename T>
+    void set(uint32_t constant_id, const T &value){
+        static_assert(std::is_trivially_copyable_v<T>, "Specialization constants are copied as raw bytes");
+        entries.emplace_back(constant_id, static_cast<uint32_t>(data.size()), sizeof(T));
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+        data.insert(data.end(), bytes, bytes + sizeof(T));
+    }
+
+    bool empty() const{
+        return entries.empty();
+    }
+};
+
+// Layout of the vertices in the vertex buffer, selected per pipeline and per object
+enum class VertexFormat{
+    Full, // Vertex: float position, normal and color (36 bytes)
+    Compact // CompactVertex: half float position and octahedral normal (12 bytes), color given per draw
+};
+
+// Everything needed to build a raster pipeline, owned by value so that the build can run on another thread
+struct RasterPipelineRequest{
+    std::string name = "default name";
+    std::string v_shader_path;
+    std::string f_shader_path;
+    std::vector<vk::DescriptorSetLayoutBinding> bindings;
+    vk::CullModeFlags cull_mode = vk::CullModeFlagBits::eBack;
+    vk::Format color_format;
+    vk::Format depth_format;
+    vk::SampleCountFlagBits msaa_samples = vk::SampleCountFlagBits::e1;
+    SpecializationConstants specialization;
+    vk::DescriptorSetLayout shared_set_layout = nullptr; // When set (e.g. the descriptor heap), used as set 0 instead of a layout built from bindings
+    std::vector<vk::PushConstantRange> push_constant_ranges;
+    VertexFormat vertex_format = VertexFormat::Full;
+};
+
 // Stuct that holds all the information about a raster pipeline
 struct RasterPipelineBundle{
     vk::raii::Pipeline pipeline = nullptr;
     vk::raii::DescriptorSetLayout descriptor_set_layout = nullptr;
+    vk::DescriptorSetLayout shared_set_layout = nullptr; // Not owned, set 0 of the pipelines reading from the descriptor heap
     vk::raii::PipelineLayout layout = nullptr;
-    vk::raii::DescriptorPool descriptor_pool = nullptr;
-    std::vector<vk::raii::DescriptorSet> descriptor_sets;
+    std::vector<vk::PushConstantRange> push_constant_ranges;
 
-    vk::raii::ShaderModule v_shader = nullptr;
-    vk::raii::ShaderModule f_shader = nullptr;
+    std::shared_ptr<vk::raii::ShaderModule> v_shader; // Shared with the other pipelines using the same code
+    std::shared_ptr<vk::raii::ShaderModule> f_shader;
     std::string v_shader_path = "";
     std::string f_shader_path = "";
 
@@ -200,6 +294,10 @@ struct RasterPipelineBundle{
     vk::PrimitiveTopology topology;
     vk::PolygonMode polygon_mode;
     vk::FrontFace front_face;
+    SpecializationConstants specialization; // Kept to rebuild the same variant when the shaders are reloaded
+    VertexFormat vertex_format = VertexFormat::Full;
+
+    double build_ms = 0.0; // Time spent compiling the pipeline object, reported at startup
 
 
     std::string pipeline_name = "default name";
@@ -224,27 +322,28 @@ struct RasterPipelineBundle{
     // Enable moving
     RasterPipelineBundle(RasterPipelineBundle&& other) noexcept
         : pipeline(std::move(other.pipeline)), descriptor_set_layout(std::move(other.descriptor_set_layout)),
-            layout(std::move(other.layout)), descriptor_pool(std::move(other.descriptor_pool)),
-            descriptor_sets(std::move(other.descriptor_sets)),
+            shared_set_layout(other.shared_set_layout), layout(std::move(other.layout)),
+            push_constant_ranges(std::move(other.push_constant_ranges)),
             v_shader(std::move(other.v_shader)),
             f_shader(std::move(other.f_shader)), pipeline_name(std::move(other.pipeline_name)),
             v_shader_path(std::move(other.v_shader_path)), f_shader_path(std::move(other.f_shader_path)),
             cull_mode(other.cull_mode), color_format(other.color_format), depth_format(other.depth_format),
             msaa_samples(other.msaa_samples), topology(other.topology), polygon_mode(other.polygon_mode),
-            front_face(other.front_face) {}
+            front_face(other.front_face), specialization(std::move(other.specialization)), vertex_format(other.vertex_format),
+            build_ms(other.build_ms) {}
     
     RasterPipelineBundle& operator=(RasterPipelineBundle&& other) noexcept{
         if(this != &other){
             pipeline = std::move(other.pipeline);
             descriptor_set_layout = std::move(other.descriptor_set_layout);
+            shared_set_layout = other.shared_set_layout;
             layout = std::move(other.layout);
-            descriptor_sets = std::move(other.descriptor_sets);
-            descriptor_pool = std::move(other.descriptor_pool);
+            push_constant_ranges = std::move(other.push_constant_ranges);
 
             v_shader = std::move(other.v_shader);
             f_shader = std::move(other.f_shader);
             v_shader_path = std::move(other.v_shader_path);
-            f_shader_path = std::move(f_shader_path);
+            f_shader_path = std::move(other.f_shader_path);
 
             cull_mode = other.cull_mode;
             color_format = other.color_format;
@@ -253,6 +352,9 @@ struct RasterPipelineBundle{
             topology = other.topology;
             polygon_mode = other.polygon_mode;
             front_face = other.front_face;
+            specialization = std::move(other.specialization);
+            vertex_format = other.vertex_format;
+            build_ms = other.build_ms;
 
             pipeline_name = std::move(other.pipeline_name);
         }
@@ -270,7 +372,11 @@ struct RasterPipelineBundle{
                      "\nMsaa samples: " << vk::to_string(msaa_samples) <<
                      "\nTopology: " << vk::to_string(topology) <<
                      "\nPolygon mode: " << vk::to_string(polygon_mode) <<
-                     "\nFront face: " << vk::to_string(front_face) << "\n"); 
+                     "\nFront face: " << vk::to_string(front_face) <<
+                     "\nSpecialization constants: " << specialization.entries.size() <<
+                     "\nVertex format: " << (vertex_format == VertexFormat::Compact ? "compact" : "full") <<
+                     "\nPush constant ranges: " << push_constant_ranges.size() <<
+                     "\nDescriptor heap: " << (shared_set_layout ? "yes" : "no") << "\n"); 
     }
 
     std::string to_str(){
@@ -308,6 +414,76 @@ struct Vertex{
     }
 };
 
+// Vertex with quantized attributes, for meshes drawn in huge numbers of instances. The color is not stored, the
+// shaders take it per draw. Positions must fit half floats, normals are unit vectors
+struct CompactVertex{
+    glm::u16vec4 position; // Half floats: x, y, z, 1
+    glm::i16vec2 normal; // Octahedral encoding, snorm
+
+    static CompactVertex pack(const Vertex &vertex){
+        // Projects the normal on the octahedron, then folds the lower half over the upper one
+        glm::vec3 n = vertex.normal / (std::abs(vertex.normal.x) + std::abs(vertex.normal.y) + std::abs(vertex.normal.z));
+        glm::vec2 octahedral(n.x, n.y);
+        if(n.z < 0.f){
+            glm::vec2 sign(n.x >= 0.f ? 1.f : -1.f, n.y >= 0.f ? 1.f : -1.f);
+            octahedral = (1.f - glm::abs(glm::vec2(n.y, n.x))) * sign;
+        }
+
+        CompactVertex compact;
+        compact.position = glm::packHalf(glm::vec4(vertex.position, 1.f));
+        compact.normal = glm::packSnorm<glm::int16>(octahedral);
+        return compact;
+    }
+
+    static vk::VertexInputBindingDescription getBindingDescription(){
+        return {0, sizeof(CompactVertex), vk::VertexInputRate::eVertex};
+    }
+
+    static std::array<vk::VertexInputAttributeDescription, 2> getAttributeDescriptions() {
+        return{
+            vk::VertexInputAttributeDescription(0, 0, vk::Format::eR16G16B16A16Sfloat, offsetof(CompactVertex, position)),
+            vk::VertexInputAttributeDescription(1, 0, vk::Format::eR16G16Snorm, offsetof(CompactVertex, normal))
+        };
+    }
+};
+static_assert(sizeof(CompactVertex) == 12, "CompactVertex must stay tightly packed");
+
+// Vertex input state of a vertex format
+struct VertexInputDescription{
+    vk::VertexInputBindingDescription binding;
+    std::vector<vk::VertexInputAttributeDescription> attributes;
+
+    static VertexInputDescription of(VertexFormat format){
+        VertexInputDescription description;
+        if(format == VertexFormat::Compact){
+            auto attributes = CompactVertex::getAttributeDescriptions();
+            description.binding = CompactVertex::getBindingDescription();
+            description.attributes.assign(attributes.begin(), attributes.end());
+        }
+        else{
+            auto attributes = Vertex::getAttributeDescriptions();
+            description.binding = Vertex::getBindingDescription();
+            description.attributes.assign(attributes.begin(), attributes.end());
+        }
+        return description;
+    }
+
+    // Bytes of a vertex in the vertex buffer
+    static uint32_t stride(VertexFormat format){
+        return format == VertexFormat::Compact ? sizeof(CompactVertex) : sizeof(Vertex);
+    }
+};
+
+// Usage classes of buffers, each one served by its own VMA pool (see MemoryAllocator::createMemoryAllocator)
+enum class MemoryClass{
+    Default, // No pool, VMA picks the memory for each allocation
+    Staging, // Short lived host visible transfer sources
+    Instance, // Per-instance data read by the shaders, written in place or uploaded
+    Uniform, // Persistently mapped per-frame data
+    Geometry, // Vertex and index buffers
+    Count
+};
+
 // Structure that holds buffer data
 struct AllocatedBuffer{
     vk::Buffer buffer = nullptr;
@@ -315,13 +491,14 @@ struct AllocatedBuffer{
     VmaAllocator allocator = nullptr;
     vk::DeviceSize size;
     VmaAllocationInfo info = {};
+    vk::DeviceAddress address = 0; // GPU pointer, only for buffers created with eShaderDeviceAddress
 
     std::string name = "default name";
 
     AllocatedBuffer() = default;
     ~AllocatedBuffer() {
         if(buffer && allocation && allocator){
-            std::cout << "Destroying buffer: " << name << std::endl;
+            MemoryAllocator::untrackAllocation(allocation);
             vmaDestroyBuffer(allocator, buffer, allocation);
             buffer = nullptr;
             allocation = nullptr;
@@ -335,16 +512,18 @@ struct AllocatedBuffer{
 
     //Enabling moving
     AllocatedBuffer(AllocatedBuffer&& other) noexcept :
-        buffer(other.buffer), allocation(other.allocation), allocator(other.allocator), info(other.info), size(other.size), name(std::move(other.name)){
+        buffer(other.buffer), allocation(other.allocation), allocator(other.allocator), info(other.info), size(other.size), address(other.address), name(std::move(other.name)){
             other.buffer = nullptr;
             other.allocation = nullptr;
             other.allocator = nullptr;
+            other.address = 0;
             other.name = "default name";
         }
     
     AllocatedBuffer& operator=(AllocatedBuffer&& other) noexcept {
         if(this != &other){
             if(buffer && allocation && allocator){
+                MemoryAllocator::untrackAllocation(allocation);
                 vmaDestroyBuffer(allocator, buffer, allocation);
             }
 
@@ -354,10 +533,12 @@ struct AllocatedBuffer{
             name = std::move(other.name);
             info = other.info;
             size = other.size;
+            address = other.address;
 
             other.buffer = nullptr;
             other.allocation = nullptr;
             other.allocator = nullptr;
+            other.address = 0;
             other.name = "default name";
         }
 
@@ -387,16 +568,21 @@ struct UniformBufferGameObjects{
     glm::mat4 model;
 };
 
-// Uniform Buffer object for mapped data
+// Push constants of the sample pipeline: the frame arena in the descriptor heap and where its data starts in it,
+// in mat4 units. They play the role of dynamic offsets, which update after bind descriptors can't have
+struct HeapPushConstants{
+    uint32_t arena_index;
+    uint32_t camera_matrix;
+    uint32_t objects_matrix;
+};
+
+// Host visible buffer with its pointer. Device::createBuffer keeps host visible buffers persistently mapped
+// (VMA_ALLOCATION_CREATE_MAPPED_BIT), so data is the allocation pointer and VMA unmaps it on destruction
 struct MappedUBO{
     AllocatedBuffer buffer;
     void *data = nullptr;
 
     MappedUBO() = default;
-    ~MappedUBO(){
-        if(buffer.allocation && buffer.allocator && data != nullptr)
-            vmaUnmapMemory(buffer.allocator, buffer.allocation);
-    }
 
     // Disable copying
     MappedUBO(const MappedUBO&) = delete;
@@ -418,6 +604,93 @@ struct MappedUBO{
     }
 };
 
+// Where a mesh lives in the MeshPool buffers, in vertices and indices. Empty for objects without geometry
+struct MeshAllocation{
+    VertexFormat format = VertexFormat::Full; // Selects the pool vertex buffer holding the vertices
+    uint32_t first_vertex = 0;
+    uint32_t vertex_count = 0;
+    uint32_t first_index = 0;
+    uint32_t index_count = 0;
+};
+
+// Per-instance attribute of an instanced batch. Each stream is its own storage buffer (structure of arrays), read by
+// the shaders from the descriptor heap at gl_InstanceIndex
+struct InstanceStream{
+    MappedUBO buffer; // Mapped only when written in place (host visible device local memory)
+    uint32_t stride = 0; // Bytes of one element
+    uint32_t count = 0; // Elements written
+    uint32_t heap_index = UINT32_MAX;
+};
+
+// Instances of one mesh drawn by one pipeline, see Engine::createInstancedBatch
+struct InstancedBatch{
+    std::string name;
+    RasterPipelineBundle *pipeline = nullptr; // Created with Engine::prepareBatchRequest
+    MeshAllocation mesh;
+    uint32_t instance_count = 0;
+    std::vector<InstanceStream> streams;
+};
+
+// Streams a batch can have, bounded by the push constants
+constexpr uint32_t MAX_INSTANCE_STREAMS = 8;
+
+// Push constants of the instanced batch pipelines
+struct BatchPushConstants{
+    glm::mat4 view_proj;
+    uint32_t instance_count;
+    uint32_t stream_count;
+    uint32_t streams[MAX_INSTANCE_STREAMS]; // Descriptor heap indices of the streams, in creation order
+};
+
+// Indirect commands of a pipeline written in the frame arena
+struct IndirectDrawRange{
+    vk::DeviceSize offset = 0;
+    uint32_t count = 0;
+};
+
+// Part of a frame arena handed out by MemoryAllocator::arenaAllocate
+struct ArenaAllocation{
+    vk::DeviceSize offset = 0;
+    void *data = nullptr;
+};
+
+// One host visible buffer per frame in flight, bump allocated for all the small data of the frame and reset once
+// the frame is waited again. Replaces one buffer and allocation per uniform with a single one
+struct FrameArena{
+    MappedUBO memory;
+    vk::DeviceSize capacity = 0;
+    vk::DeviceSize alignment = 1; // Every allocation starts at a multiple of it
+    vk::DeviceSize head = 0; // Bytes allocated this frame
+    vk::DeviceSize peak = 0; // Highest head reached, reported on exit
+    uint32_t heap_index = UINT32_MAX; // Slot of the buffer in the descriptor heap
+};
+
+// Holds resources that the GPU might still be using. Each frame in flight owns one queue, which is flushed
+// after the graphics timeline value of that frame has been waited again: by then every submission that could reference the resources is complete
+struct DeletionQueue{
+    std::vector<std::function<void()>> deletors;
+
+    // Generic deletion callback, for anything that isn't a movable resource
+    void push(std::function<void()> &&deletor){
+        deletors.push_back(std::move(deletor));
+    }
+
+    // Moves the resource out (leaving the original empty, ready to be reassigned) and destroys it on flush
+    template<typename T>
+    void retire(T &resource){
+        auto holder = std::make_shared<T>(std::move(resource));
+        deletors.push_back([holder]() mutable { holder.reset(); });
+    }
+
+    // Destroys the resources in reverse retirement order
+    void flush(){
+        for(auto it = deletors.rbegin(); it != deletors.rend(); ++it){
+            (*it)();
+        }
+        deletors.clear();
+    }
+};
+
 
 enum class InputState{
     PRESSED,
@@ -1,4 +1,10 @@
 #version 450
+#extension GL_EXT_buffer_reference : require
+
+// Variant selected when the pipeline is built, the disabled paths are removed from the compiled shader
+layout(constant_id = 2) const int LIGHTING_MODEL = 1; // 0: ambient only, 1: windowed point lights
+layout(constant_id = 3) const int MAX_LIGHTS = 3368421; // Upper bound of the lights evaluated per fragment
+layout(constant_id = 4) const float AMBIENT = 0.1;
 
 // Input from vertex shader
 layout(location = 10) in vec3 fragPos;
@@ -11,27 +17,26 @@ struct Pointlight{
     vec4 color;
 };
 
-layout(std430, binding = 3) readonly buffer PointlightSSBO {
+layout(buffer_reference, std430, buffer_reference_align = 16) readonly buffer Pointlights {
     vec4 num; // only first value used for current number of pointlights
     Pointlight lights[]; 
-} pointlights;
+};
+
+// Part of the vertex shader block, MengerPushConstants
+layout(push_constant) uniform FrameConstants {
+    layout(offset = 104) Pointlights pointlights;
+} frame;
 
 
 // Ouput of fragment shader
 layout(location = 0) out vec4 outColor;
 
-// Light info
-vec3 ambient = vec3(0.1, 0.1, 0.1);
-vec3 light_pos = vec3(10, 10, 10);
-vec3 light_col = vec3(0.4);
-
-void main(){
-   vec3 norm = normalize(fragNorm);
+vec3 pointlightDiffuse(){
+    vec3 norm = normalize(fragNorm);
     vec3 total_diffuse = vec3(0.0);
+    Pointlights pointlights = frame.pointlights;
     
-    int num_lights = int(pointlights.num.x);
-
-    const float THRESHOLD = 0.01; 
+    int num_lights = min(int(pointlights.num.x), MAX_LIGHTS);
 
     for (int i = 0; i < num_lights; i++) {
         vec3 diff = pointlights.lights[i].position.xyz - fragPos;
@@ -53,6 +58,14 @@ void main(){
         total_diffuse += diff_coeff * pointlights.lights[i].color.rgb * attenuation;
     }
 
-    vec3 finalColor = (ambient + total_diffuse) * fragColor;
-    outColor = vec4(finalColor, 1.0);
-}
\ No newline at end of file
+    return total_diffuse;
+}
+
+void main(){
+    vec3 light = vec3(AMBIENT);
+    if(LIGHTING_MODEL == 1){
+        light += pointlightDiffuse();
+    }
+
+    outColor = vec4(light * fragColor, 1.0);
+}
@@ -1,39 +1,94 @@
 #version 450
+#extension GL_EXT_buffer_reference : require
 
-// Locations defined by Vertex struct
-layout(location = 0) in vec3 inPosition;
-layout(location = 1) in vec3 inNormal;
-layout(location = 2) in vec3 inColor;
+// Variant selected when the pipeline is built, the disabled paths are removed from the compiled shader
+layout(constant_id = 0) const bool ROTATION = true; // false when the cube doesn't rotate, skips the rotation
+layout(constant_id = 1) const bool PROCEDURAL_INSTANCING = false; // cube positions computed from the instance index instead of the SSBO
+
+// Locations defined by CompactVertex struct
+layout(location = 0) in vec3 inPosition; // Half floats, the fourth component is not needed
+layout(location = 1) in vec2 inNormal; // Octahedral encoding
 
 // Output locations (to fragment shader)
 layout(location = 10) out vec3 fragPos;
 layout(location = 11) out vec3 fragNorm;
 layout(location = 12) out vec3 fragColor;
 
-layout(binding = 0) uniform UniformBufferCamera {
-    mat4 view;
-    mat4 proj;
-} cam_ubo;
-
-layout(std430, binding = 1) readonly buffer CubesSSBO {
+// Buffers of the active level, read through their device address
+layout(buffer_reference, std430, buffer_reference_align = 16) readonly buffer CubePositions {
     vec4 positions[]; 
-} obj_buffer;
+};
 
-layout(binding = 2) uniform UniformBufferCube{
-    mat4 rotate_matrix;
+// Everything read per frame, matches MengerPushConstants
+layout(push_constant) uniform FrameConstants {
+    mat4 view_proj;
+    vec4 rotation; // Quaternion of the main cube
     vec4 center_and_scale;
-}cube_ubo;
+    CubePositions cubes;
+    uvec2 lights; // Address only read by the fragment shader
+    float menger_size; // Size of the cube before any subdivision
+    uint menger_steps; // Subdivisions of the active level
+    uint base_color; // RGBA8, the same for every cube
+} frame;
+
+// Sub cubes kept by a subdivision, in the order the CPU generates them
+const ivec3 SUB_CUBES[20] = ivec3[20](
+    ivec3(0, 0, 0), ivec3(0, 0, 1), ivec3(0, 0, 2), ivec3(0, 1, 0), ivec3(0, 1, 2), ivec3(0, 2, 0), ivec3(0, 2, 1), ivec3(0, 2, 2),
+    ivec3(1, 0, 0), ivec3(1, 0, 2), ivec3(1, 2, 0), ivec3(1, 2, 2),
+    ivec3(2, 0, 0), ivec3(2, 0, 1), ivec3(2, 0, 2), ivec3(2, 1, 0), ivec3(2, 1, 2), ivec3(2, 2, 0), ivec3(2, 2, 1), ivec3(2, 2, 2)
+);
+
+// Every subdivision multiplies the cubes by 20, so the base 20 digits of the instance index, most significant first,
+// are the sub cubes chosen at each step
+vec3 proceduralPosition(uint instance){
+    uint steps = frame.menger_steps;
+    uint divisor = 1u;
+    for(uint s = 1u; s < steps; s++){
+        divisor *= 20u;
+    }
+
+    vec3 pos = vec3(0.0); // Positions are relative to the level center
+    float size = frame.menger_size;
+    for(uint s = 0u; s < steps; s++){
+        size /= 3.0;
+        pos += vec3(SUB_CUBES[(instance / divisor) % 20u] - 1) * size;
+        divisor /= 20u;
+    }
+    return pos;
+}
+
+// Unfolds a normal from its octahedral encoding, see CompactVertex::pack
+vec3 decodeNormal(vec2 e){
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if(n.z < 0.0){
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return normalize(n);
+}
+
+// Rotates v by the unit quaternion q
+vec3 rotate(vec4 q, vec3 v){
+    return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v);
+}
 
 void main(){
-    vec3 pos = inPosition * cube_ubo.center_and_scale.w;
-    pos += obj_buffer.positions[gl_InstanceIndex].xyz;
+    vec3 pos = inPosition * frame.center_and_scale.w;
+    if(PROCEDURAL_INSTANCING){
+        pos += proceduralPosition(uint(gl_InstanceIndex));
+    }
+    else{
+        pos += frame.cubes.positions[gl_InstanceIndex].xyz;
+    }
 
-    mat3 rotate_matrix = mat3(cube_ubo.rotate_matrix);
-    pos = rotate_matrix * pos;
-    pos += cube_ubo.center_and_scale.xyz;
+    vec3 norm = decodeNormal(inNormal);
+    if(ROTATION){
+        pos = rotate(frame.rotation, pos);
+        norm = rotate(frame.rotation, norm);
+    }
+    pos += frame.center_and_scale.xyz;
 
-    gl_Position = cam_ubo.proj * cam_ubo.view * vec4(pos, 1.0);
+    gl_Position = frame.view_proj * vec4(pos, 1.0);
     fragPos = pos;
-    fragNorm = rotate_matrix * inNormal;
-    fragColor = inColor;
-}
\ No newline at end of file
+    fragNorm = norm;
+    fragColor = unpackUnorm4x8(frame.base_color).rgb;
+}
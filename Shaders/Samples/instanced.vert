@@ -0,0 +1,35 @@
+#version 450
+#extension GL_EXT_nonuniform_qualifier : require
+
+// Locations defined by Vertex struct
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+layout(location = 2) in vec3 inColor;
+
+// Output locations (to fragment shader)
+layout(location = 10) out vec3 fragColor;
+
+// Descriptor heap: every storage buffer lives in binding 0, each stream is read with the type of its elements
+layout(std430, set = 0, binding = 0) readonly buffer Vec4Stream {
+    vec4 values[];
+} vec4_streams[];
+
+layout(std430, set = 0, binding = 0) readonly buffer UintStream {
+    uint values[];
+} uint_streams[];
+
+// Matches BatchPushConstants: heap index of each stream of the batch
+layout(push_constant) uniform Batch{
+    mat4 view_proj;
+    uint instance_count;
+    uint stream_count;
+    uint streams[8];
+} batch;
+
+void main(){
+    // Stream 0: offset and scale, stream 1: RGBA8 color
+    vec4 offset_and_scale = vec4_streams[batch.streams[0]].values[gl_InstanceIndex];
+    vec4 color = unpackUnorm4x8(uint_streams[batch.streams[1]].values[gl_InstanceIndex]);
+    gl_Position = batch.view_proj * vec4(inPosition * offset_and_scale.w + offset_and_scale.xyz, 1.0);
+    fragColor = inColor * color.rgb;
+}
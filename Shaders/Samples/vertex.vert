@@ -1,4 +1,5 @@
 #version 450
+#extension GL_EXT_nonuniform_qualifier : require
 
 // Locations defined by Vertex struct
 layout(location = 0) in vec3 inPosition;
@@ -8,16 +9,22 @@ layout(location = 2) in vec3 inColor;
 // Output locations (to fragment shader)
 layout(location = 10) out vec3 fragColor;
 
-layout(binding = 0) uniform UniformBufferCamera {
-    mat4 view;
-    mat4 proj;
-} cam_ubo;
+// Descriptor heap: every storage buffer lives in binding 0. The frame arena is read as an array of matrices
+layout(std430, set = 0, binding = 0) readonly buffer FrameArena {
+    mat4 matrices[];
+} arenas[];
 
-layout(binding = 1) uniform UniformBufferGameObject{
-    mat4 model;
-}obj_ubo[10];
+// Frame arena of this frame and where camera (view, proj) and object models start in it, in matrices
+layout(push_constant) uniform ArenaOffsets{
+    uint arena_index;
+    uint camera_matrix;
+    uint objects_matrix;
+} frame;
 
 void main(){
-    gl_Position = cam_ubo.proj * cam_ubo.view * obj_ubo[gl_InstanceIndex].model * vec4(inPosition, 1.0);
+    mat4 view = arenas[frame.arena_index].matrices[frame.camera_matrix];
+    mat4 proj = arenas[frame.arena_index].matrices[frame.camera_matrix + 1];
+    mat4 model = arenas[frame.arena_index].matrices[frame.objects_matrix + gl_InstanceIndex];
+    gl_Position = proj * view * model * vec4(inPosition, 1.0);
     fragColor = inColor;
 }
\ No newline at end of file
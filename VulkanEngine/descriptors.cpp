@@ -0,0 +1,163 @@
+#include "descriptors.hpp"
+
+#include <algorithm>
+
+void DescriptorHeap::create(const vk::raii::PhysicalDevice &physical_device, vk::raii::Device &logical_device,
+                            uint32_t max_storage_buffers, uint32_t max_sampled_images, uint32_t max_storage_images)
+{
+    this -> logical_device = &logical_device;
+
+    // Arrays bound with update after bind have their own, usually much higher, limits
+    auto properties = physical_device.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceVulkan12Properties>();
+    const vk::PhysicalDeviceVulkan12Properties &limits = properties.get<vk::PhysicalDeviceVulkan12Properties>();
+    slots[STORAGE_BUFFER_BINDING].capacity = std::min({max_storage_buffers,
+                                                       limits.maxDescriptorSetUpdateAfterBindStorageBuffers,
+                                                       limits.maxPerStageDescriptorUpdateAfterBindStorageBuffers});
+    slots[SAMPLED_IMAGE_BINDING].capacity = std::min({max_sampled_images,
+                                                      limits.maxDescriptorSetUpdateAfterBindSampledImages,
+                                                      limits.maxDescriptorSetUpdateAfterBindSamplers,
+                                                      limits.maxPerStageDescriptorUpdateAfterBindSampledImages,
+                                                      limits.maxPerStageDescriptorUpdateAfterBindSamplers});
+    slots[STORAGE_IMAGE_BINDING].capacity = std::min({max_storage_images,
+                                                      limits.maxDescriptorSetUpdateAfterBindStorageImages,
+                                                      limits.maxPerStageDescriptorUpdateAfterBindStorageImages});
+
+    // Every binding is visible to all stages, so the three arrays together count against the per stage limit. They are
+    // scaled down proportionally when their sum exceeds it, keeping a few resources for the attachments and other sets
+    const uint64_t reserved_resources = 16;
+    uint64_t total = uint64_t(slots[STORAGE_BUFFER_BINDING].capacity) + slots[SAMPLED_IMAGE_BINDING].capacity + slots[STORAGE_IMAGE_BINDING].capacity;
+    uint64_t budget = limits.maxPerStageUpdateAfterBindResources > reserved_resources ? limits.maxPerStageUpdateAfterBindResources - reserved_resources : 0;
+    if(total > budget){
+        for(Slots &binding_slots : slots){
+            binding_slots.capacity = std::max(1u, static_cast<uint32_t>(binding_slots.capacity * budget / total));
+        }
+        std::cout << "Descriptor heap scaled down to the per stage limit of " << limits.maxPerStageUpdateAfterBindResources << " resources" << std::endl;
+    }
+
+    std::array<vk::DescriptorSetLayoutBinding, 3> bindings = {
+        vk::DescriptorSetLayoutBinding(STORAGE_BUFFER_BINDING, vk::DescriptorType::eStorageBuffer, slots[STORAGE_BUFFER_BINDING].capacity, vk::ShaderStageFlagBits::eAll, nullptr),
+        vk::DescriptorSetLayoutBinding(SAMPLED_IMAGE_BINDING, vk::DescriptorType::eCombinedImageSampler, slots[SAMPLED_IMAGE_BINDING].capacity, vk::ShaderStageFlagBits::eAll, nullptr),
+        vk::DescriptorSetLayoutBinding(STORAGE_IMAGE_BINDING, vk::DescriptorType::eStorageImage, slots[STORAGE_IMAGE_BINDING].capacity, vk::ShaderStageFlagBits::eAll, nullptr)
+    };
+
+    // Partially bound: empty slots are fine as long as they are not accessed
+    // Update after bind and unused while pending: new slots are written while frames using the set are in flight
+    vk::DescriptorBindingFlags binding_flag = vk::DescriptorBindingFlagBits::ePartiallyBound |
+                                              vk::DescriptorBindingFlagBits::eUpdateAfterBind |
+                                              vk::DescriptorBindingFlagBits::eUpdateUnusedWhilePending;
+    std::array<vk::DescriptorBindingFlags, 3> binding_flags = {binding_flag, binding_flag, binding_flag};
+
+    vk::DescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info;
+    binding_flags_info.bindingCount = static_cast<uint32_t>(binding_flags.size());
+    binding_flags_info.pBindingFlags = binding_flags.data();
+
+    vk::DescriptorSetLayoutCreateInfo layout_info({}, bindings.size(), bindings.data());
+    layout_info.flags = vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPool;
+    layout_info.pNext = &binding_flags_info;
+    layout = vk::raii::DescriptorSetLayout(logical_device, layout_info);
+
+    std::array<vk::DescriptorPoolSize, 3> pool_sizes = {
+        vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, slots[STORAGE_BUFFER_BINDING].capacity),
+        vk::DescriptorPoolSize(vk::DescriptorType::eCombinedImageSampler, slots[SAMPLED_IMAGE_BINDING].capacity),
+        vk::DescriptorPoolSize(vk::DescriptorType::eStorageImage, slots[STORAGE_IMAGE_BINDING].capacity)
+    };
+
+    vk::DescriptorPoolCreateInfo pool_info;
+    pool_info.flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet | vk::DescriptorPoolCreateFlagBits::eUpdateAfterBind;
+    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+    pool_info.pPoolSizes = pool_sizes.data();
+    pool = vk::raii::DescriptorPool(logical_device, pool_info);
+
+    vk::DescriptorSetAllocateInfo alloc_info(*pool, 1, &*layout);
+    set = std::move(logical_device.allocateDescriptorSets(alloc_info).front());
+
+    std::cout << "Descriptor heap: " << slots[STORAGE_BUFFER_BINDING].capacity << " storage buffers, "
+              << slots[SAMPLED_IMAGE_BINDING].capacity << " sampled images, "
+              << slots[STORAGE_IMAGE_BINDING].capacity << " storage images" << std::endl;
+}
+
+void DescriptorHeap::destroy()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    set = nullptr;
+    pool = nullptr;
+    layout = nullptr;
+    slots = {};
+}
+
+uint32_t DescriptorHeap::allocateSlot(uint32_t binding)
+{
+    Slots &binding_slots = slots[binding];
+    if(!binding_slots.free_slots.empty()){
+        uint32_t index = binding_slots.free_slots.back();
+        binding_slots.free_slots.pop_back();
+        return index;
+    }
+    if(binding_slots.next >= binding_slots.capacity){
+        throw std::runtime_error("Descriptor heap binding " + std::to_string(binding) + " is full (" + std::to_string(binding_slots.capacity) + " slots)");
+    }
+    return binding_slots.next++;
+}
+
+uint32_t DescriptorHeap::addStorageBuffer(vk::Buffer buffer, vk::DeviceSize offset, vk::DeviceSize range)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t index = allocateSlot(STORAGE_BUFFER_BINDING);
+
+    vk::DescriptorBufferInfo buffer_info(buffer, offset, range);
+    vk::WriteDescriptorSet write(*set, STORAGE_BUFFER_BINDING, index, 1, vk::DescriptorType::eStorageBuffer, nullptr, &buffer_info, nullptr);
+    logical_device -> updateDescriptorSets(write, nullptr);
+
+    return index;
+}
+
+uint32_t DescriptorHeap::addSampledImage(vk::ImageView image_view, vk::Sampler sampler, vk::ImageLayout image_layout)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t index = allocateSlot(SAMPLED_IMAGE_BINDING);
+
+    vk::DescriptorImageInfo image_info(sampler, image_view, image_layout);
+    vk::WriteDescriptorSet write(*set, SAMPLED_IMAGE_BINDING, index, 1, vk::DescriptorType::eCombinedImageSampler, &image_info, nullptr, nullptr);
+    logical_device -> updateDescriptorSets(write, nullptr);
+
+    return index;
+}
+
+uint32_t DescriptorHeap::addStorageImage(vk::ImageView image_view)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    uint32_t index = allocateSlot(STORAGE_IMAGE_BINDING);
+
+    vk::DescriptorImageInfo image_info(nullptr, image_view, vk::ImageLayout::eGeneral);
+    vk::WriteDescriptorSet write(*set, STORAGE_IMAGE_BINDING, index, 1, vk::DescriptorType::eStorageImage, &image_info, nullptr, nullptr);
+    logical_device -> updateDescriptorSets(write, nullptr);
+
+    return index;
+}
+
+void DescriptorHeap::release(uint32_t binding, uint32_t index)
+{
+    if(index == INVALID_INDEX){
+        return;
+    }
+    // The descriptor is left as is, partially bound only requires that nobody reads it until it is written again
+    std::lock_guard<std::mutex> lock(mutex);
+    slots[binding].free_slots.push_back(index);
+}
+
+void DescriptorHeap::bind(vk::raii::CommandBuffer &command_buffer, const vk::raii::PipelineLayout &pipeline_layout, vk::PipelineBindPoint bind_point) const
+{
+    command_buffer.bindDescriptorSets(bind_point, pipeline_layout, 0, *set, {});
+}
+
+void DescriptorHeap::printStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const std::array<std::string, 3> names = {"storage buffers", "sampled images", "storage images"};
+    std::cout << "Descriptor heap usage:";
+    for(size_t i = 0; i < slots.size(); i++){
+        std::cout << " " << names[i] << " " << slots[i].next - slots[i].free_slots.size() << "/" << slots[i].capacity;
+    }
+    std::cout << std::endl;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "../Helpers/GeneralLibraries.hpp"
+
+#include <mutex>
+
+// Global bindless descriptor set: large partially bound arrays of storage buffers, sampled images and storage images.
+// Resources are written once when registered and the shaders index the arrays with values passed as push constants,
+// so adding objects or buffers never allocates descriptor sets nor rebinds them. Thread safe
+class DescriptorHeap{
+public:
+    static constexpr uint32_t STORAGE_BUFFER_BINDING = 0;
+    static constexpr uint32_t SAMPLED_IMAGE_BINDING = 1;
+    static constexpr uint32_t STORAGE_IMAGE_BINDING = 2;
+    static constexpr uint32_t INVALID_INDEX = UINT32_MAX;
+
+    DescriptorHeap() = default;
+
+    // Disable copying and moving, the slots are referenced by index from the shaders
+    DescriptorHeap(const DescriptorHeap&) = delete;
+    DescriptorHeap& operator=(const DescriptorHeap&) = delete;
+
+    // Creates layout, pool and the single set. Capacities are clamped to the update after bind limits of the device
+    void create(const vk::raii::PhysicalDevice &physical_device, vk::raii::Device &logical_device,
+                uint32_t max_storage_buffers, uint32_t max_sampled_images, uint32_t max_storage_images);
+
+    // Releases the set, its pool and layout. Must be called before destroying the device
+    void destroy();
+
+    // Writes a resource into a free slot and returns its index. Slots not used by pending frames can be written while
+    // the set is bound (update unused while pending)
+    uint32_t addStorageBuffer(vk::Buffer buffer, vk::DeviceSize offset = 0, vk::DeviceSize range = vk::WholeSize);
+    uint32_t addSampledImage(vk::ImageView image_view, vk::Sampler sampler, vk::ImageLayout image_layout = vk::ImageLayout::eShaderReadOnlyOptimal);
+    uint32_t addStorageImage(vk::ImageView image_view);
+
+    // Returns a slot to the free list. The frames using it must have completed: retire it through the deletion queue
+    void release(uint32_t binding, uint32_t index);
+
+    // Binds the heap as set 0 of a pipeline layout created with getLayout()
+    void bind(vk::raii::CommandBuffer &command_buffer, const vk::raii::PipelineLayout &pipeline_layout, vk::PipelineBindPoint bind_point = vk::PipelineBindPoint::eGraphics) const;
+
+    const vk::raii::DescriptorSetLayout &getLayout() const{
+        return layout;
+    }
+
+    // Prints used and available slots of each array
+    void printStats();
+
+private:
+    // Slots of one array: never used ones past next, released ones in free_slots
+    struct Slots{
+        uint32_t capacity = 0;
+        uint32_t next = 0;
+        std::vector<uint32_t> free_slots;
+    };
+
+    std::mutex mutex; // Protects the slots and the descriptor writes
+    vk::raii::Device *logical_device = nullptr;
+    vk::raii::DescriptorSetLayout layout = nullptr;
+    vk::raii::DescriptorPool pool = nullptr;
+    vk::raii::DescriptorSet set = nullptr;
+    std::array<Slots, 3> slots; // [binding]
+
+    // Takes a free slot of a binding, throws when the array is full. The mutex must be held
+    uint32_t allocateSlot(uint32_t binding);
+};
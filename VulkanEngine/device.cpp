@@ -1,4 +1,5 @@
 #include "device.hpp"
+#include "memory.hpp"
 
 // Helper function for VmaResults
 const char* Device::VmaResultToString(VkResult r) {
@@ -59,17 +60,29 @@ vk::raii::Device Device::createLogicalDevice(const vk::raii::PhysicalDevice &phy
     std::set<uint32_t> unique_queue_families = {
         indices.graphics_family.value(),
         indices.present_family.value(),
-        indices.transfer_family.value()
+        indices.transfer_family.value(),
+        indices.compute_family.value()
     };
 
     // Enabling all required features
     vk::PhysicalDeviceFeatures2 deviceFeatures2 = {};
     deviceFeatures2.features.sampleRateShading = vk::True;
+    deviceFeatures2.features.multiDrawIndirect = vk::True;
+    deviceFeatures2.features.drawIndirectFirstInstance = vk::True;
 
     vk::PhysicalDeviceVulkan12Features vulkan12features;
     vulkan12features.bufferDeviceAddress = true; // Memory can be referenced by a pointer rather than just a descriptor set
     vulkan12features.descriptorBindingPartiallyBound = true;
     vulkan12features.scalarBlockLayout = true;
+    vulkan12features.timelineSemaphore = true;
+    // Descriptor indexing, used by the bindless descriptor heap
+    vulkan12features.runtimeDescriptorArray = true;
+    vulkan12features.shaderStorageBufferArrayNonUniformIndexing = true;
+    vulkan12features.shaderSampledImageArrayNonUniformIndexing = true;
+    vulkan12features.descriptorBindingStorageBufferUpdateAfterBind = true;
+    vulkan12features.descriptorBindingSampledImageUpdateAfterBind = true;
+    vulkan12features.descriptorBindingStorageImageUpdateAfterBind = true;
+    vulkan12features.descriptorBindingUpdateUnusedWhilePending = true;
 
     vk::PhysicalDeviceVulkan13Features vulkan13features;
     vulkan13features.synchronization2 = true;
@@ -162,7 +175,9 @@ uint8_t Device::calculateScore(vk::raii::PhysicalDevice &device){
 
     bool supports_required_features =
         features.template get<vk::PhysicalDeviceExtendedDynamicStateFeaturesEXT>().extendedDynamicState && // Change pipeline states (cull mode, front face, ...) dynamically
-        features.template get<vk::PhysicalDeviceFeatures2>().features.sampleRateShading; // fragment shader runs per-sample and not per-pixel, remove to increase performance 
+        features.template get<vk::PhysicalDeviceFeatures2>().features.sampleRateShading && // fragment shader runs per-sample and not per-pixel, remove to increase performance 
+        features.template get<vk::PhysicalDeviceFeatures2>().features.multiDrawIndirect && // Many draws from a single indirect buffer
+        features.template get<vk::PhysicalDeviceFeatures2>().features.drawIndirectFirstInstance; // Indirect draws starting from an instance other than 0
     
     bool supports_vulkan_11_features = 
         true; // No base features required for a standard engine, change if needed
@@ -170,7 +185,15 @@ uint8_t Device::calculateScore(vk::raii::PhysicalDevice &device){
     bool supports_vulkan_12_properties =
         features.template get<vk::PhysicalDeviceVulkan12Features>().bufferDeviceAddress && // Allows for pointer to buffer, bypass the need to bind a buffer to a descriptor set
         features.template get<vk::PhysicalDeviceVulkan12Features>().descriptorBindingPartiallyBound && // Allows for partially constructed descriptor sets
-        features.template get<vk::PhysicalDeviceVulkan12Features>().scalarBlockLayout; // relaxes alignment rules
+        features.template get<vk::PhysicalDeviceVulkan12Features>().scalarBlockLayout && // relaxes alignment rules
+        features.template get<vk::PhysicalDeviceVulkan12Features>().timelineSemaphore && // Semaphores with a counter, waited on by value from the CPU or other queues
+        features.template get<vk::PhysicalDeviceVulkan12Features>().runtimeDescriptorArray && // Unsized descriptor arrays in the shaders
+        features.template get<vk::PhysicalDeviceVulkan12Features>().shaderStorageBufferArrayNonUniformIndexing && // Arrays indexed with values varying inside a draw
+        features.template get<vk::PhysicalDeviceVulkan12Features>().shaderSampledImageArrayNonUniformIndexing &&
+        features.template get<vk::PhysicalDeviceVulkan12Features>().descriptorBindingStorageBufferUpdateAfterBind && // Descriptors written while the set is bound
+        features.template get<vk::PhysicalDeviceVulkan12Features>().descriptorBindingSampledImageUpdateAfterBind &&
+        features.template get<vk::PhysicalDeviceVulkan12Features>().descriptorBindingStorageImageUpdateAfterBind &&
+        features.template get<vk::PhysicalDeviceVulkan12Features>().descriptorBindingUpdateUnusedWhilePending; // Descriptors written while frames using other ones are in flight
 
     bool supports_vulkan_13_properties = 
         features.template get<vk::PhysicalDeviceVulkan13Features>().dynamicRendering && // Allows rendering without a render pass or frame buffer
@@ -205,6 +228,13 @@ void Device::findQueueFamilies(const vk::raii::PhysicalDevice &physical_device,
             indices.transfer_family = i;
         }
 
+        // Find a dedicated compute queue (async compute), so that compute work can overlap the graphics queue
+        if(indices.prefer_async_compute && !indices.compute_family.has_value() &&
+            (queue_family.queueFlags & vk::QueueFlagBits::eCompute) &&
+            !(queue_family.queueFlags & vk::QueueFlagBits::eGraphics)){
+            indices.compute_family = i;
+        }
+
         // Find a presentation queue
         if(physical_device.getSurfaceSupportKHR(i, *surface)){
             indices.present_family = i;
@@ -220,6 +250,11 @@ void Device::findQueueFamilies(const vk::raii::PhysicalDevice &physical_device,
     if(!indices.transfer_family.has_value() && indices.graphics_family.has_value()){
         indices.transfer_family = indices.graphics_family;
     }
+
+    // Graphics families always support compute, the same queue is used if there is no dedicated family or it is disabled
+    if(!indices.compute_family.has_value() && indices.graphics_family.has_value()){
+        indices.compute_family = indices.graphics_family;
+    }
 }
 
 vk::raii::CommandPool Device::createCommandPool(const vk::raii::Device &logical_device, vk::CommandPoolCreateFlagBits flags, uint32_t queue_index)
@@ -242,23 +277,27 @@ vk::raii::CommandBuffers Device::createCommandBuffer(vk::raii::CommandPool &comm
 
 }
 
-AllocatedBuffer Device::createBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags properties, std::string name, VmaAllocator &vma_allocator)
+vk::raii::CommandBuffer &Device::getSecondaryCommandBuffer(ThreadCommandPool &thread_pool, vk::raii::Device &logical_device)
 {
-    AllocatedBuffer buffer;
+    if(thread_pool.used >= thread_pool.secondary_buffers.size()){
+        vk::CommandBufferAllocateInfo alloc_info;
+        alloc_info.commandPool = thread_pool.pool;
+        alloc_info.level = vk::CommandBufferLevel::eSecondary;
+        alloc_info.commandBufferCount = 1;
 
-    // Prepare VMA alloc info
-    VmaAllocationCreateInfo alloc_info = {};
-    alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
-
-    // Decide flags by host-visible property
-    if ((properties & vk::MemoryPropertyFlagBits::eHostVisible) != vk::MemoryPropertyFlags{}) {
-        // Staging-like buffer: request mapped & sequential write host access
-        alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
-    } else {
-        // Device-only buffer: no special flags (not mapped)
-        alloc_info.flags = 0;
+        thread_pool.secondary_buffers.push_back(std::move(logical_device.allocateCommandBuffers(alloc_info).front()));
     }
 
+    return thread_pool.secondary_buffers[thread_pool.used++];
+}
+
+// Creates the buffer and its allocation as described by alloc_info, shared by the buffer creation functions.
+// The allocation comes from the pool of its memory class when it fits there
+static AllocatedBuffer allocateBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, VmaAllocationCreateInfo alloc_info, MemoryClass memory_class,
+                                      std::string name, VmaAllocator &vma_allocator)
+{
+    AllocatedBuffer buffer;
+
     // Fill VkBufferCreateInfo (use raw Vulkan struct via cast)
     vk::BufferCreateInfo buffer_info{};
     buffer_info.size = size;
@@ -267,23 +306,90 @@ AllocatedBuffer Device::createBuffer(vk::DeviceSize size, vk::BufferUsageFlags u
 
 
     VkBuffer temp_buffer;
-    VkResult r = vmaCreateBuffer(vma_allocator, reinterpret_cast<VkBufferCreateInfo const*>(&buffer_info), 
-            &alloc_info, &temp_buffer, &buffer.allocation, &buffer.info);
+    VkResult r = VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    alloc_info.pool = MemoryAllocator::choosePool(memory_class, size);
+    if(alloc_info.pool){
+        r = vmaCreateBuffer(vma_allocator, reinterpret_cast<VkBufferCreateInfo const*>(&buffer_info), 
+                &alloc_info, &temp_buffer, &buffer.allocation, &buffer.info);
+        // Full pool heap or memory type not allowed for this buffer: VMA chooses the memory instead
+        if(r != VK_SUCCESS){
+            MemoryAllocator::countPoolFallback(memory_class);
+            alloc_info.pool = nullptr;
+        }
+    }
+    if(!alloc_info.pool){
+        r = vmaCreateBuffer(vma_allocator, reinterpret_cast<VkBufferCreateInfo const*>(&buffer_info), 
+                &alloc_info, &temp_buffer, &buffer.allocation, &buffer.info);
+    }
     if (r != VK_SUCCESS) {
         std::stringstream ss;
-        ss << "vmaCreateBuffer failed: " << VmaResultToString(r) << " (" << r << ")";
+        ss << "vmaCreateBuffer failed: " << Device::VmaResultToString(r) << " (" << r << ")";
         throw std::runtime_error(ss.str());
     }
     else{
         buffer.buffer = vk::Buffer(temp_buffer);
     }
+
+    // Buffers read through a pointer in the shaders (GL_EXT_buffer_reference) keep their address
+    if(usage & vk::BufferUsageFlagBits::eShaderDeviceAddress){
+        VmaAllocatorInfo allocator_info;
+        vmaGetAllocatorInfo(vma_allocator, &allocator_info);
+        VkBufferDeviceAddressInfo address_info{VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, nullptr, temp_buffer};
+        buffer.address = vkGetBufferDeviceAddress(allocator_info.device, &address_info);
+    }
     buffer.allocator = vma_allocator;
     buffer.name = name;
     buffer.size = size;
 
+    MemoryAllocator::trackAllocation(vma_allocator, buffer.allocation, name);
+
     return buffer;
 }
 
+AllocatedBuffer Device::createBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags properties, std::string name, VmaAllocator &vma_allocator,
+                                     MemoryClass memory_class)
+{
+    // Prepare VMA alloc info
+    VmaAllocationCreateInfo alloc_info = {};
+    alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
+
+    // Decide flags by host-visible property
+    if ((properties & vk::MemoryPropertyFlagBits::eHostVisible) != vk::MemoryPropertyFlags{}) {
+        // Staging-like buffer: request mapped & sequential write host access
+        alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT;
+    } else {
+        // Device-only buffer: no special flags (not mapped)
+        alloc_info.flags = 0;
+    }
+
+    return allocateBuffer(size, usage, alloc_info, memory_class, name, vma_allocator);
+}
+
+AllocatedBuffer Device::createDirectWriteBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, std::string name, VmaAllocator &vma_allocator)
+{
+    // VMA prefers a device local and host visible type. With ALLOW_TRANSFER_INSTEAD it may fall back to device local
+    // only memory, where the MAPPED bit is ignored, instead of using slower system memory
+    VmaAllocationCreateInfo alloc_info = {};
+    alloc_info.usage = VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE;
+    alloc_info.flags = VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT |
+                       VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT;
+
+    AllocatedBuffer buffer = allocateBuffer(size, usage | vk::BufferUsageFlagBits::eTransferDst, alloc_info, MemoryClass::Instance, name, vma_allocator);
+
+    VkMemoryPropertyFlags memory_properties;
+    vmaGetAllocationMemoryProperties(vma_allocator, buffer.allocation, &memory_properties);
+    if(!(memory_properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)){
+        buffer.info.pMappedData = nullptr;
+    }
+
+    return buffer;
+}
+
+void Device::flushBuffer(AllocatedBuffer &buffer)
+{
+    vmaFlushAllocation(buffer.allocator, buffer.allocation, 0, VK_WHOLE_SIZE);
+}
+
 void Device::copyBuffer(AllocatedBuffer &source_buffer, AllocatedBuffer &destination_buffer, 
     vk::DeviceSize size, vk::raii::Device &logical_device, QueuePool &queue_pool, vk::DeviceSize src_offset)
 {
@@ -292,6 +398,27 @@ void Device::copyBuffer(AllocatedBuffer &source_buffer, AllocatedBuffer &destina
     endSingleTimeCommands(command_buffer_copy, queue_pool.transfer_queue);
 }
 
+void Device::bufferBarrier(vk::Buffer buffer, vk::AccessFlags2 src_access_mask, vk::AccessFlags2 dst_access_mask, vk::PipelineStageFlags2 src_stage_mask, vk::PipelineStageFlags2 dst_stage_mask,
+                           uint32_t src_queue_family, uint32_t dst_queue_family, vk::raii::CommandBuffer &command_buffer)
+{
+    vk::BufferMemoryBarrier2 barrier{};
+    barrier.srcStageMask = src_stage_mask;
+    barrier.dstStageMask = dst_stage_mask;
+    barrier.srcAccessMask = src_access_mask;
+    barrier.dstAccessMask = dst_access_mask;
+    barrier.srcQueueFamilyIndex = src_queue_family;
+    barrier.dstQueueFamilyIndex = dst_queue_family;
+    barrier.buffer = buffer;
+    barrier.offset = 0;
+    barrier.size = vk::WholeSize;
+
+    vk::DependencyInfo dependency_info{};
+    dependency_info.bufferMemoryBarrierCount = 1;
+    dependency_info.pBufferMemoryBarriers = &barrier;
+
+    command_buffer.pipelineBarrier2(dependency_info);
+}
+
 vk::raii::CommandBuffer Device::beginSingleTimeCommands(vk::raii::CommandPool& command_pool, vk::raii::Device &logical_device){
     vk::CommandBufferAllocateInfo alloc_info;
     alloc_info.commandPool = command_pool;
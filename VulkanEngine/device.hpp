@@ -21,16 +21,33 @@ namespace Device{
     // Creates the necessary command buffers
     vk::raii::CommandBuffers createCommandBuffer(vk::raii::CommandPool &command_pool, vk::CommandBufferLevel level, int max_frames_in_flight, vk::raii::Device &logical_device);
 
+    // Returns the next unused secondary command buffer of a thread pool, allocating a new one if needed
+    vk::raii::CommandBuffer &getSecondaryCommandBuffer(ThreadCommandPool &thread_pool, vk::raii::Device &logical_device);
+
     // Helper function for printing vma operation results
     const char* VmaResultToString(VkResult r);
 
-    // Creates a buffer
-    AllocatedBuffer createBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags properties, std::string name, VmaAllocator &vma_allocator);
+    // Creates a buffer, in the pool of its memory class if any. With eShaderDeviceAddress in usage, its GPU address is stored in the returned buffer
+    AllocatedBuffer createBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, vk::MemoryPropertyFlags properties, std::string name, VmaAllocator &vma_allocator,
+                                 MemoryClass memory_class = MemoryClass::Default);
+
+    // Creates a GPU read buffer the host writes directly when the device exposes device local and host visible memory
+    // (resizable BAR, integrated GPUs): the returned buffer is then mapped (info.pMappedData). Otherwise VMA places it in
+    // device local memory only and the caller has to upload it through a staging buffer. eTransferDst is always added.
+    // Allocated in the instance pool
+    AllocatedBuffer createDirectWriteBuffer(vk::DeviceSize size, vk::BufferUsageFlags usage, std::string name, VmaAllocator &vma_allocator);
+
+    // Makes host writes to a mapped buffer visible to the device, a no-op on host coherent memory
+    void flushBuffer(AllocatedBuffer &buffer);
 
     // Copies one buffer into another
     void copyBuffer(AllocatedBuffer &source_buffer, AllocatedBuffer &destination_buffer, vk::DeviceSize size, vk::raii::Device &logical_device, QueuePool &queue_pool,
                     vk::DeviceSize src_offset);
     
+    // Records a buffer memory barrier. Different queue families turn it into the release or acquire half of an ownership transfer
+    void bufferBarrier(vk::Buffer buffer, vk::AccessFlags2 src_access_mask, vk::AccessFlags2 dst_access_mask, vk::PipelineStageFlags2 src_stage_mask, vk::PipelineStageFlags2 dst_stage_mask,
+                       uint32_t src_queue_family, uint32_t dst_queue_family, vk::raii::CommandBuffer &command_buffer);
+    
     // Functions for single time commands
     vk::raii::CommandBuffer beginSingleTimeCommands(vk::raii::CommandPool &command_pool, vk::raii::Device &logical_device);
     void endSingleTimeCommands(vk::raii::CommandBuffer &command_buffer, vk::raii::Queue &queue);
@@ -1,5 +1,7 @@
 #include "engine.hpp"
 
+#include <algorithm>
+
 // --- HELPER FUNCTIONS ---
 
 // Gets GLFW extensions for Vulkan and necessary extensions for debugging
@@ -32,13 +34,32 @@ void Engine::setupDebugMessanger(){
     debug_messanger = instance.createDebugUtilsMessengerEXT(debugUtilsMessengerCreateInfoEXT);
 }
 
+void Engine::reportMemory(const std::string &label)
+{
+    MemoryAllocator::printMemoryReport(vma_allocator, label);
+    MemoryAllocator::dumpMemoryReport(vma_allocator, label, memory_report_path, !memory_report_started);
+    memory_report_started = true;
+}
+
 
 // --- INITIALIZATION FUNCTIONS ---
-void Engine::init(const std::string title, uint32_t &w, uint32_t &h)
+void Engine::init(const std::string title, uint32_t &w, uint32_t &h, const EngineConfig &config)
 {
     this -> title = title;
     this -> win_width = w;
     this -> win_height = h;
+    this -> config = config;
+
+    if(config.frames_in_flight < 1 || config.frames_in_flight > 4){
+        throw std::runtime_error("Frames in flight must be between 1 and 4!");
+    }
+    queue_pool.max_frames_in_flight = config.frames_in_flight;
+
+    int worker_threads = config.worker_threads;
+    if(worker_threads < 0){
+        worker_threads = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    }
+    job_system.start(worker_threads);
 
     initWindow();
 
@@ -56,7 +77,7 @@ void Engine::initWindow()
     }
     window = GLFWHelper::initWindowGLFW(title.c_str(), win_width, win_height);
 
-    glfwSetWindowUserPointer(window, &inputs);
+    glfwSetWindowUserPointer(window, this);
 
     std::cout << "width: " << win_width << " height: " << win_height << std::endl;
 
@@ -65,6 +86,7 @@ void Engine::initWindow()
     }
 
     glfwSetKeyCallback(window, recordInput);
+    glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
 }
 
 // Initialize all Vulkan Components
@@ -76,14 +98,21 @@ void Engine::initVulkan(){
     // Device setup
     std::cout << "\nDEVICE SETUP..." << std::endl;
     physical_device = Device::pickPhysicalDevice(instance);
+    queue_pool.prefer_async_compute = config.async_compute;
     logical_device = Device::createLogicalDevice(physical_device, surface, queue_pool);
 
     queue_pool.graphics_queue = vk::raii::Queue(logical_device, queue_pool.graphics_family.value(), 0);
     queue_pool.transfer_queue = vk::raii::Queue(logical_device, queue_pool.transfer_family.value(), 0);
     queue_pool.present_queue = vk::raii::Queue(logical_device, queue_pool.present_family.value(), 0);
+    queue_pool.compute_queue = vk::raii::Queue(logical_device, queue_pool.compute_family.value(), 0);
     if(!queue_pool.isQueueComplete()){
         throw std::runtime_error("Error during creation of queues!");
     }
+    queue_pool.graphics_timeline = Sync::createTimeline(logical_device);
+    queue_pool.transfer_timeline = Sync::createTimeline(logical_device);
+    queue_pool.compute_timeline = Sync::createTimeline(logical_device);
+    std::cout << "Compute family: " << queue_pool.compute_family.value()
+              << (queue_pool.compute_family != queue_pool.graphics_family ? " (async)" : " (graphics queue)") << std::endl;
 
     /**
      * eResetCommandBuffer -> allows to reset individual command buffers allocated from this pool without having to reset the entire pool at once
@@ -91,37 +120,64 @@ void Engine::initVulkan(){
      */
     queue_pool.graphics_command_pool = Device::createCommandPool(logical_device, vk::CommandPoolCreateFlagBits::eResetCommandBuffer, queue_pool.graphics_family.value());
     queue_pool.transfer_command_pool = Device::createCommandPool(logical_device, vk::CommandPoolCreateFlagBits::eTransient, queue_pool.transfer_family.value());
+    queue_pool.compute_command_pool = Device::createCommandPool(logical_device, vk::CommandPoolCreateFlagBits::eResetCommandBuffer, queue_pool.compute_family.value());
     if(!queue_pool.isPoolComplete()){
         throw std::runtime_error("Error during creation of command pools!");
     }
 
     queue_pool.graphics_command_buffers = Device::createCommandBuffer(queue_pool.graphics_command_pool, vk::CommandBufferLevel::ePrimary, queue_pool.max_frames_in_flight, logical_device);
+    queue_pool.compute_command_buffers = Device::createCommandBuffer(queue_pool.compute_command_pool, vk::CommandBufferLevel::ePrimary, queue_pool.max_frames_in_flight, logical_device);
+
+    // One pool per recording thread and frame in flight, command pools can't be used from multiple threads at once
+    queue_pool.thread_command_pools.clear();
+    queue_pool.thread_command_pools.resize(queue_pool.max_frames_in_flight);
+    for(std::vector<ThreadCommandPool> &frame_pools : queue_pool.thread_command_pools){
+        frame_pools.resize(job_system.getWorkerCount() + 1);
+        for(ThreadCommandPool &thread_pool : frame_pools){
+            thread_pool.pool = Device::createCommandPool(logical_device, vk::CommandPoolCreateFlagBits::eTransient, queue_pool.graphics_family.value());
+        }
+    }
     
     // Swapchain setup
     std::cout << "\nSWAPCHAIN SETUP..." << std::endl;
-    swapchain = Swapchain::createSwapchain(physical_device, logical_device, surface, window, queue_pool);
+    swapchain = Swapchain::createSwapchain(physical_device, logical_device, surface, window, queue_pool, config.present_mode, config.swapchain_images);
+    std::cout << "Frames in flight: " << queue_pool.max_frames_in_flight << std::endl;
 
     // Memory Allocator setup
     std::cout << "\nMEMORY ALLOCATOR SETUP..." << std::endl;
     vma_allocator = MemoryAllocator::createMemoryAllocator(physical_device, logical_device, instance);
 
-    // Color Image setup
+    // Color and depth images setup
     std::cout << "\nCOLOR IMAGE SETUP..." << std::endl;
-    color_image = Image::createImage(swapchain.extent.width, swapchain.extent.height, vk::ImageType::e2D,
-                                    1, msaa_samples, swapchain.format, 1, vk::ImageTiling::eOptimal,
-                                vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eColorAttachment, vk::MemoryPropertyFlagBits::eDeviceLocal, 
-                                "color image", {}, vma_allocator);
-    color_image.image_view = Image::createImageView(color_image, logical_device);
-
-    depth_image = Image::createImage(swapchain.extent.width, swapchain.extent.height, vk::ImageType::e2D,
-                                    1, msaa_samples, Image::findDepthFormat(physical_device), 1,
-                                    vk::ImageTiling::eOptimal, vk::ImageUsageFlagBits::eDepthStencilAttachment,
-                                    vk::MemoryPropertyFlagBits::eDeviceLocal, "depth image", {}, vma_allocator);
-    depth_image.image_view = Image::createImageView(depth_image, logical_device);
+    createAttachments();
 
     // Pipeline Setup
     std::cout << "\nGENERAL SCENE RESOURCES SETUP..." << std::endl;
+    pipeline_cache = Pipeline::createPipelineCache(physical_device, logical_device, pipeline_cache_path, config.load_pipeline_cache, pipeline_cache_loaded);
+    descriptor_heap.create(physical_device, logical_device, 65536, 16384, 4096);
+    createFrameArenas();
+    mesh_pool.create(262144, 1048576, vma_allocator);
+    // Meshes of destroyed objects are released with the frame; before the first one nothing can be drawing them
+    mesh_pool.setRetirer([this](std::function<void()> &&release){
+        if(deletion_queues.empty()){
+            release();
+            return;
+        }
+        deletion_queues[current_frame].push(std::move(release));
+    });
+    auto init_resources_start = std::chrono::high_resolution_clock::now();
     createInitResources();
+    reportPipelineStartup(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - init_resources_start).count());
+    ShaderCache::printStats();
+    descriptor_heap.printStats();
+    mesh_pool.printStats();
+
+    if(config.hot_reload){
+        reload_jobs.start(1);
+        shader_watcher.start("Shaders", std::chrono::milliseconds(500));
+    }
+
+    reportMemory("startup");
 
     // Synchronization objects Setup
     std::cout << "\nSYNCHRONIZATION OBJECTS SETUP..." << std::endl;
@@ -197,113 +253,232 @@ void Engine::createSurface(){
 void Engine::createInitResources(){
 
     int total_obj = 10;
+
+    // The pipeline compiles on a worker while the buffers are created. It has no bindings of its own: camera and objects
+    // are read from the frame arena in the descriptor heap, at the offsets given by the push constants
+    RasterPipelineRequest request;
+    request.name = "dumb pipeline";
+    request.v_shader_path = "Shaders/Samples/vertex.vert.spv";
+    request.f_shader_path = "Shaders/Samples/fragment.frag.spv";
+    request.shared_set_layout = *descriptor_heap.getLayout();
+    request.push_constant_ranges = {vk::PushConstantRange(vk::ShaderStageFlagBits::eVertex, 0, sizeof(HeapPushConstants))};
+    request.cull_mode = vk::CullModeFlagBits::eBack;
+    request.color_format = swapchain.format;
+    request.depth_format = Image::findDepthFormat(physical_device);
+    request.msaa_samples = msaa_samples;
+    std::future<RasterPipelineBundle> pipeline_build = buildRasterPipeline(std::move(request));
+
+    // Instanced grid of the same mesh, positions and colors come from the batch streams
+    RasterPipelineRequest grid_request;
+    grid_request.name = "instanced grid";
+    grid_request.v_shader_path = "Shaders/Samples/instanced.vert.spv";
+    grid_request.f_shader_path = "Shaders/Samples/fragment.frag.spv";
+    prepareBatchRequest(grid_request);
+    grid_request.cull_mode = vk::CullModeFlagBits::eBack;
+    grid_request.color_format = swapchain.format;
+    grid_request.depth_format = Image::findDepthFormat(physical_device);
+    grid_request.msaa_samples = msaa_samples;
+    std::future<RasterPipelineBundle> grid_build = buildRasterPipeline(std::move(grid_request));
+
     objects.reserve(total_obj);
     for(int i = 0; i < total_obj; i++){
         objects.push_back(Gameobject(glm::vec3(-(total_obj/2) + i, 0, -5), glm::vec3(1), glm::vec3(-45.f, 45.f, 0.f), glm::vec3(0, 0, 0), glm::vec3(.1f, .1f, 0)));
     }
-    objects[0].start(vma_allocator, logical_device, queue_pool);
-
-    ubo_objects_mapped.clear();
-    ubo_objects_mapped.resize(total_obj);
-    vk::DeviceSize gameobject_buffer_size = sizeof(UniformBufferGameObjects);
-    for(size_t i = 0; i < total_obj; i++){
-        ubo_objects_mapped[i].resize(queue_pool.max_frames_in_flight);
-        for(size_t j = 0; j < queue_pool.max_frames_in_flight; j++){
-            ubo_objects_mapped[i][j].buffer = Device::createBuffer(
-                gameobject_buffer_size,
-                vk::BufferUsageFlagBits::eUniformBuffer,
-                vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-                "Gameobject Buffer",
-                vma_allocator
-            );
-            vmaMapMemory(vma_allocator, ubo_objects_mapped[i][j].buffer.allocation, &ubo_objects_mapped[i][j].data);
-        }
+    for(Gameobject &object : objects){
+        object.start(mesh_pool, vma_allocator, logical_device, queue_pool);
     }
 
     // CAMERA RESOURCES SETUP
-    ubo_camera_mapped.clear();
-    ubo_camera_mapped.resize(queue_pool.max_frames_in_flight);
-    vk::DeviceSize camera_buffer_size = sizeof(UniformBufferCamera);
-
-    for(size_t i = 0; i < queue_pool.max_frames_in_flight; i++){
-        ubo_camera_mapped[i].buffer = Device::createBuffer(
-            camera_buffer_size,
-            vk::BufferUsageFlagBits::eUniformBuffer,
-            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-            "Camera Buffer",
-            vma_allocator
-        );
-        vmaMapMemory(vma_allocator, ubo_camera_mapped[i].buffer.allocation, &ubo_camera_mapped[i].data);
-    }
-
+    // Camera and object matrices are written every frame in the frame arena, see updateUniformBuffers
     camera = Camera(glm::vec3(0, 0, 2));
 
 
 
-    const std::string vertex_shader_path = "Shaders/Samples/vertex.vert.spv";
-    const std::string fragment_shader_path = "Shaders/Samples/fragment.frag.spv";
-
-    std::vector<vk::DescriptorSetLayoutBinding> bindings = {
-        // Binding 0: Camera Uniform Object
-        vk::DescriptorSetLayoutBinding(
-            0, // binding location
-            vk::DescriptorType::eUniformBuffer, // Type of binding
-            1, // binding count
-            vk::ShaderStageFlagBits::eVertex,
-            nullptr
-        ),
-
-        // Binding 1: GameObject Uniform Buffer
-        vk::DescriptorSetLayoutBinding(
-            1,
-            vk::DescriptorType::eUniformBuffer,
-            total_obj,
-            vk::ShaderStageFlagBits::eVertex,
-            nullptr
-        )
-    };
-    std::string name = "dumb pipeline";
-    raster_pipelines.push_back(Pipeline::createsRasterPipeline(vertex_shader_path, fragment_shader_path,
-                                                    &bindings, vk::CullModeFlagBits::eBack, swapchain.format, 
-                                                    Image::findDepthFormat(physical_device), msaa_samples, 
-                                                    name, nullptr, logical_device
-                                                    ));
-    
-    raster_pipelines[0].descriptor_pool = Pipeline::createDescriptorPool(bindings, logical_device, queue_pool.max_frames_in_flight);
-    raster_pipelines[0].descriptor_sets = Pipeline::createDescriptorSets(raster_pipelines[0].descriptor_set_layout,
-                                                                        raster_pipelines[0].descriptor_pool,
-                                                                        logical_device,
-                                                                        queue_pool.max_frames_in_flight);
-    std::vector<void *> resources{
-        &ubo_camera_mapped,
-        &ubo_objects_mapped
-    };
-    Pipeline::writeDescriptorSets(raster_pipelines[0].descriptor_sets, bindings, resources, logical_device, queue_pool.max_frames_in_flight);
+    // Reserved: objects and batches keep pointers to the bundles
+    raster_pipelines.reserve(2);
+    raster_pipelines.push_back(pipeline_build.get());
+    raster_pipelines.push_back(grid_build.get());
 
-    
     pip_to_obj[&raster_pipelines[0]] = std::vector<Gameobject*>();
     pip_to_obj[&raster_pipelines[0]].reserve(objects.size());
     for(size_t i = 0; i < objects.size(); i++){
         pip_to_obj[&raster_pipelines[0]].push_back(&objects[i]);
     }
+
+    // Stream 0: offset and scale, stream 1: RGBA8 color
+    const int grid_side = 32;
+    std::vector<glm::vec4> offsets;
+    std::vector<uint32_t> colors;
+    offsets.reserve(grid_side * grid_side);
+    colors.reserve(grid_side * grid_side);
+    for(int x = 0; x < grid_side; x++){
+        for(int z = 0; z < grid_side; z++){
+            offsets.push_back(glm::vec4(x - grid_side / 2, -2.f, -z - 8.f, .25f));
+            colors.push_back(glm::packUnorm4x8(glm::vec4(x * 1.f / grid_side, .5f, z * 1.f / grid_side, 1.f)));
+        }
+    }
+    uint32_t grid = createInstancedBatch("instanced grid", raster_pipelines[1], objects[0].getMesh(), {sizeof(glm::vec4), sizeof(uint32_t)});
+    writeInstanceStream(grid, 0, offsets.data(), static_cast<uint32_t>(offsets.size()));
+    writeInstanceStream(grid, 1, colors.data(), static_cast<uint32_t>(colors.size()));
 }
 
-void Engine::createSyncObjects()
+void Engine::createAttachments()
+{
+    color_image = Image::createImage(swapchain.extent.width, swapchain.extent.height, vk::ImageType::e2D,
+                                    1, msaa_samples, swapchain.format, 1, vk::ImageTiling::eOptimal,
+                                vk::ImageUsageFlagBits::eTransferDst | vk::ImageUsageFlagBits::eColorAttachment, vk::MemoryPropertyFlagBits::eDeviceLocal, 
+                                "color image", {}, vma_allocator);
+    color_image.image_view = Image::createImageView(color_image, logical_device);
+
+    depth_image = Image::createImage(swapchain.extent.width, swapchain.extent.height, vk::ImageType::e2D,
+                                    1, msaa_samples, Image::findDepthFormat(physical_device), 1,
+                                    vk::ImageTiling::eOptimal, vk::ImageUsageFlagBits::eDepthStencilAttachment,
+                                    vk::MemoryPropertyFlagBits::eDeviceLocal, "depth image", {}, vma_allocator);
+    depth_image.image_view = Image::createImageView(depth_image, logical_device);
+}
+
+void Engine::createSwapchainSemaphores()
 {
     present_complete_semaphores.clear();
     render_finished_semaphores.clear();
-    in_flight_fences.clear();
+    present_semaphore_index = 0;
 
     for(size_t i = 0; i < swapchain.images.size(); i++){
         present_complete_semaphores.emplace_back(vk::raii::Semaphore(logical_device, vk::SemaphoreCreateInfo()));
         render_finished_semaphores.emplace_back(vk::raii::Semaphore(logical_device, vk::SemaphoreCreateInfo()));
     }
+}
+
+void Engine::updateShaderReloads()
+{
+    for(const std::string &source : shader_watcher.takeChanges()){
+        // Shaders are compiled next to their source, as the Makefile does
+        const std::string spirv = source + ".spv";
+        std::vector<RasterPipelineBundle *> bundles;
+        for(RasterPipelineBundle &pipeline : raster_pipelines){
+            if(std::filesystem::path(pipeline.v_shader_path).lexically_normal().generic_string() == spirv ||
+               std::filesystem::path(pipeline.f_shader_path).lexically_normal().generic_string() == spirv){
+                bundles.push_back(&pipeline);
+            }
+        }
+
+        std::cout << "Shader changed: " << source << ", recompiling (" << bundles.size() << " pipelines affected)" << std::endl;
+        shader_reloads.push_back(reload_jobs.submit([this, source, bundles](uint32_t){
+            return reloadShader(source, bundles);
+        }));
+    }
+
+    bool swapped = false;
+    for(auto reload_it = shader_reloads.begin(); reload_it != shader_reloads.end();){
+        if(reload_it -> wait_for(std::chrono::seconds(0)) != std::future_status::ready){
+            reload_it++;
+            continue;
+        }
 
+        ShaderReload reload = reload_it -> get();
+        reload_it = shader_reloads.erase(reload_it);
+
+        if(!reload.compiled){
+            std::cout << "Failed to compile " << reload.source << ":\n" << reload.log << std::endl;
+            continue;
+        }
+        std::cout << "Compiled " << reload.source << " in " << reload.compile_ms << " ms" << std::endl;
+        if(!reload.log.empty()){
+            std::cout << reload.log << std::endl;
+        }
+
+        // Frames in flight may still use the previous pipeline, it goes through the deletion queue
+        for(ReloadedPipeline &reloaded : reload.pipelines){
+            retireResource(reloaded.bundle -> pipeline);
+            reloaded.bundle -> pipeline = std::move(reloaded.pipeline);
+            reloaded.bundle -> v_shader = std::move(reloaded.v_shader);
+            reloaded.bundle -> f_shader = std::move(reloaded.f_shader);
+            reloaded.bundle -> build_ms = reloaded.build_ms;
+            std::cout << "Rebuilt pipeline " << reloaded.bundle -> pipeline_name << " in " << reloaded.build_ms << " ms" << std::endl;
+            swapped = true;
+        }
+    }
+
+    if(swapped){
+        ShaderCache::releaseUnused();
+    }
+}
+
+ShaderReload Engine::reloadShader(const std::string &source, const std::vector<RasterPipelineBundle *> &bundles)
+{
+    ShaderReload reload;
+    reload.source = source;
+
+    auto compile_start = std::chrono::high_resolution_clock::now();
+    reload.compiled = ShaderCache::compile(source, source + ".spv", reload.log);
+    reload.compile_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - compile_start).count();
+    if(!reload.compiled){
+        return reload;
+    }
+
+    // Only paths, layout and states of the bundles are read here, the render thread never modifies them
+    for(RasterPipelineBundle *bundle : bundles){
+        try{
+            ReloadedPipeline reloaded;
+            reloaded.bundle = bundle;
+            reloaded.v_shader = ShaderCache::loadModule(bundle -> v_shader_path, logical_device);
+            reloaded.f_shader = ShaderCache::loadModule(bundle -> f_shader_path, logical_device);
+
+            auto build_start = std::chrono::high_resolution_clock::now();
+            reloaded.pipeline = Pipeline::createPipelineObject(*bundle, *reloaded.v_shader, *reloaded.f_shader, logical_device, &pipeline_cache);
+            reloaded.build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - build_start).count();
+
+            reload.pipelines.push_back(std::move(reloaded));
+        }
+        catch(const std::exception &error){
+            reload.log += "Failed to rebuild " + bundle -> pipeline_name + ": " + error.what() + "\n";
+        }
+    }
+
+    return reload;
+}
+
+std::future<RasterPipelineBundle> Engine::buildRasterPipeline(RasterPipelineRequest request)
+{
+    return job_system.submit([this, request = std::move(request)](uint32_t) mutable{
+        return Pipeline::createsRasterPipeline(request, logical_device, &pipeline_cache);
+    });
+}
+
+void Engine::reportPipelineStartup(double init_resources_ms)
+{
+    double pipelines_ms = 0.0;
+    for(const RasterPipelineBundle &pipeline : raster_pipelines){
+        pipelines_ms += pipeline.build_ms;
+    }
+
+    std::cout << "Pipeline startup (" << (pipeline_cache_loaded > 0 ? "warm" : "cold") << " cache, " << pipeline_cache_loaded / 1024.0 << " KB loaded): "
+              << raster_pipelines.size() << " pipelines compiled in " << pipelines_ms << " ms, "
+              << "init resources created in " << init_resources_ms << " ms" << std::endl;
+}
+
+void Engine::createFrameArenas()
+{
+    frame_arenas.clear();
+    frame_arenas.reserve(queue_pool.max_frames_in_flight);
     for(size_t i = 0; i < queue_pool.max_frames_in_flight; i++){
-        in_flight_fences.emplace_back(vk::raii::Fence(logical_device, {vk::FenceCreateFlagBits::eSignaled}));
+        frame_arenas.push_back(MemoryAllocator::createFrameArena(FRAME_ARENA_SIZE, physical_device, "Frame Arena " + std::to_string(i), vma_allocator));
+        frame_arenas[i].heap_index = descriptor_heap.addStorageBuffer(frame_arenas[i].memory.buffer.buffer);
     }
 }
 
+void Engine::createSyncObjects()
+{
+    deletion_queues.clear();
+    graphics_waits.clear();
+
+    createSwapchainSemaphores();
+
+    // Frames are paced on the graphics timeline, 0 is reached before anything is submitted
+    frame_timeline_values.assign(queue_pool.max_frames_in_flight, 0);
+    deletion_queues.resize(queue_pool.max_frames_in_flight);
+}
+
 
 // --- RUN FUNCTIONS ---
 
@@ -318,39 +493,81 @@ void Engine::run(){
 
 void Engine::drawFrame()
 {
+    std::chrono::_V2::system_clock::time_point current_time = std::chrono::high_resolution_clock::now();
+    time = std::chrono::duration<float, std::chrono::milliseconds::period>(current_time - prev_time).count();
+    prev_time = current_time;
+
+    // The frame consuming the pending input is the one whose present closes the latency measurement
+    std::optional<std::chrono::high_resolution_clock::time_point> frame_input_time = pending_input_time;
+    pending_input_time.reset();
+
+    // The CPU work of the frame runs on the workers while this thread waits for the GPU and the swapchain
+    JobHandle frame_job = scheduleFrameJobs(time);
+
     // CPU block
-    while(vk::Result::eTimeout == logical_device.waitForFences(*in_flight_fences[current_frame], vk::True, UINT64_MAX));
+    Sync::wait(queue_pool.graphics_timeline, frame_timeline_values[current_frame], logical_device);
+
+    // Everything retired the last time this frame was recorded is no longer in use
+    deletion_queues[current_frame].flush();
+    MemoryAllocator::resetArena(frame_arenas[current_frame]);
+    for(ThreadCommandPool &thread_pool : queue_pool.thread_command_pools[current_frame]){
+        thread_pool.pool.reset();
+        thread_pool.used = 0;
+    }
 
     // GPU block
-    auto [result, image_index] = swapchain.swapchain.acquireNextImage(UINT64_MAX, *present_complete_semaphores[present_semaphore_index], nullptr);
+    // An out of date swapchain is recreated and the acquire retried, so this frame is still submitted on its slot
+    // and the resources retired by the recreation are released only after the frames using them have completed
+    vk::Result result;
+    uint32_t image_index;
+    while(true){
+        try{
+            std::tie(result, image_index) = swapchain.swapchain.acquireNextImage(UINT64_MAX, *present_complete_semaphores[present_semaphore_index], nullptr);
+            break;
+        }
+        catch(const vk::OutOfDateKHRError &){
+            // The frame jobs read the swapchain extent and the inputs, which the recreation may change
+            JobSystem::wait(frame_job);
+            recreateSwapchain();
+        }
+    }
 
     if(result != vk::Result::eSuccess && result != vk::Result::eSuboptimalKHR){
         throw std::runtime_error("failed to acquire swap chain image!");
     }
 
     // Resetting the synchronization components
-    logical_device.resetFences(*in_flight_fences[current_frame]);
     queue_pool.graphics_command_buffers[current_frame].reset();
 
-    std::chrono::_V2::system_clock::time_point current_time = std::chrono::high_resolution_clock::now();
-    time = std::chrono::duration<float, std::chrono::milliseconds::period>(current_time - prev_time).count();
-    prev_time = current_time;
-
-    processInput();
-    updateUniformBuffers(time, current_frame);
+    JobSystem::wait(frame_job);
+    updateUniformBuffers(current_frame);
+    batch_view_proj = getViewProjection();
+    submitComputeCommands();
+    // Swapped after the wait and the flush of this slot: the retired pipelines go to a queue flushed only once this
+    // frame completed, so the previous frame still running on the other slot keeps them alive
+    updateShaderReloads();
     recordCommandBuffer(image_index);
 
-    vk::PipelineStageFlags wait_destination_stage_mask(vk::PipelineStageFlagBits::eColorAttachmentOutput);
-    vk::SubmitInfo submit_info;
-    submit_info.waitSemaphoreCount = 1;
-    submit_info.pWaitSemaphores = &*present_complete_semaphores[present_semaphore_index];
-    submit_info.pWaitDstStageMask = &wait_destination_stage_mask;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &*queue_pool.graphics_command_buffers[current_frame];
-    submit_info.signalSemaphoreCount = 1;
-    submit_info.pSignalSemaphores = &*render_finished_semaphores[image_index];
+    // The swapchain semaphores stay binary, the frame completion is signaled on the graphics timeline
+    graphics_waits.push_back(vk::SemaphoreSubmitInfo(*present_complete_semaphores[present_semaphore_index], 0, vk::PipelineStageFlagBits2::eColorAttachmentOutput));
 
-    queue_pool.graphics_queue.submit(submit_info, *in_flight_fences[current_frame]);
+    frame_timeline_values[current_frame] = Sync::nextValue(queue_pool.graphics_timeline);
+    std::array<vk::SemaphoreSubmitInfo, 2> signal_infos = {
+        vk::SemaphoreSubmitInfo(*render_finished_semaphores[image_index], 0, vk::PipelineStageFlagBits2::eAllCommands),
+        Sync::submitInfo(queue_pool.graphics_timeline, frame_timeline_values[current_frame], vk::PipelineStageFlagBits2::eAllCommands)
+    };
+
+    vk::CommandBufferSubmitInfo command_buffer_info(*queue_pool.graphics_command_buffers[current_frame]);
+    vk::SubmitInfo2 submit_info;
+    submit_info.waitSemaphoreInfoCount = static_cast<uint32_t>(graphics_waits.size());
+    submit_info.pWaitSemaphoreInfos = graphics_waits.data();
+    submit_info.commandBufferInfoCount = 1;
+    submit_info.pCommandBufferInfos = &command_buffer_info;
+    submit_info.signalSemaphoreInfoCount = static_cast<uint32_t>(signal_infos.size());
+    submit_info.pSignalSemaphoreInfos = signal_infos.data();
+
+    queue_pool.graphics_queue.submit2(submit_info);
+    graphics_waits.clear();
 
     vk::PresentInfoKHR present_info_KHR;
     present_info_KHR.waitSemaphoreCount = 1;
@@ -359,24 +576,142 @@ void Engine::drawFrame()
     present_info_KHR.pSwapchains = &*swapchain.swapchain;
     present_info_KHR.pImageIndices = &image_index;
 
-    result = queue_pool.present_queue.presentKHR(present_info_KHR);
-    switch(result){
-        case vk::Result::eSuccess: break;
-        case vk::Result::eSuboptimalKHR:
-            std::cout << "vk::Queue::presentKHR returned vk::Result::eSuboptimalKHR !\n";
-            break;
-        default: break; // an unexpected result is returned
+    try{
+        result = queue_pool.present_queue.presentKHR(present_info_KHR);
+    }
+    catch(const vk::OutOfDateKHRError &){
+        result = vk::Result::eErrorOutOfDateKHR;
     }
 
-    current_frame = (current_frame + 1) % queue_pool.max_frames_in_flight;
     present_semaphore_index = (present_semaphore_index + 1) % present_complete_semaphores.size();
+
+    if(frame_input_time.has_value()){
+        recordLatency(frame_input_time.value());
+    }
+
+    if(result == vk::Result::eSuboptimalKHR || result == vk::Result::eErrorOutOfDateKHR || framebuffer_resized){
+        recreateSwapchain();
+    }
+
+    current_frame = (current_frame + 1) % queue_pool.max_frames_in_flight;
+}
+
+void Engine::recreateSwapchain()
+{
+    // A minimized window has an empty framebuffer, nothing can be presented until it is restored
+    int width = 0, height = 0;
+    glfwGetFramebufferSize(window, &width, &height);
+    while(width == 0 || height == 0){
+        glfwWaitEvents();
+        glfwGetFramebufferSize(window, &width, &height);
+    }
+    framebuffer_resized = false;
+
+    // The old swapchain is handed over to the new one, then retired together with its image views.
+    // Frames still in flight keep rendering and presenting with the old resources
+    SwapchainBundle new_swapchain = Swapchain::createSwapchain(physical_device, logical_device, surface, window, queue_pool,
+                                                               config.present_mode, config.swapchain_images, *swapchain.swapchain);
+    retireResource(swapchain);
+    swapchain = std::move(new_swapchain);
+    win_width = swapchain.extent.width;
+    win_height = swapchain.extent.height;
+
+    retireResource(color_image);
+    retireResource(depth_image);
+    createAttachments();
+
+    // The semaphores are indexed by swapchain image and may still be waited on by pending presents
+    retireResource(present_complete_semaphores);
+    retireResource(render_finished_semaphores);
+    createSwapchainSemaphores();
+}
+
+void Engine::framebufferResizeCallback(GLFWwindow *window, int width, int height)
+{
+    Engine *engine = reinterpret_cast<Engine *>(glfwGetWindowUserPointer(window));
+    engine -> framebuffer_resized = true;
 }
 
 void Engine::recordInput(GLFWwindow *window, int key, int scancode, int action, int mods)
 {
-    std::map<int, InputState> &inputs = *reinterpret_cast<std::map<int, InputState> *>(glfwGetWindowUserPointer(window));
+    Engine *engine = reinterpret_cast<Engine *>(glfwGetWindowUserPointer(window));
+    std::map<int, InputState> &inputs = engine -> inputs;
 
     inputs[key] = action == GLFW_PRESS ? InputState::PRESSED : (action == GLFW_REPEAT ? InputState::HOLD : InputState::RELEASED);
+
+    // Only presses start a measurement: releases and repeats do not wait for a visible response
+    if(action == GLFW_PRESS && !engine -> pending_input_time.has_value()){
+        engine -> pending_input_time = std::chrono::high_resolution_clock::now();
+    }
+}
+
+void Engine::submitComputeCommands()
+{
+    if(!hasComputeWork()){
+        return;
+    }
+
+    // The graphics submission of this frame waits for the compute one, so the buffer is free once the frame value is reached
+    vk::raii::CommandBuffer &command_buffer = queue_pool.compute_command_buffers[current_frame];
+    command_buffer.reset();
+    command_buffer.begin({});
+    vk::PipelineStageFlags2 consumer_stages = recordComputeCommands(command_buffer);
+    command_buffer.end();
+
+    if(!consumer_stages){
+        return; // Nothing recorded, no need to go through the queue
+    }
+
+    uint64_t compute_value = Sync::nextValue(queue_pool.compute_timeline);
+    vk::SemaphoreSubmitInfo signal_info = Sync::submitInfo(queue_pool.compute_timeline, compute_value, vk::PipelineStageFlagBits2::eComputeShader);
+    vk::CommandBufferSubmitInfo command_buffer_info(*command_buffer);
+    vk::SubmitInfo2 submit_info;
+    submit_info.commandBufferInfoCount = 1;
+    submit_info.pCommandBufferInfos = &command_buffer_info;
+    submit_info.signalSemaphoreInfoCount = 1;
+    submit_info.pSignalSemaphoreInfos = &signal_info;
+    queue_pool.compute_queue.submit2(submit_info);
+
+    waitBeforeGraphics(queue_pool.compute_timeline, compute_value, consumer_stages);
+}
+
+vk::PipelineStageFlags2 Engine::recordComputeCommands(vk::raii::CommandBuffer &command_buffer)
+{
+    return {};
+}
+
+bool Engine::hasComputeWork()
+{
+    return false;
+}
+
+void Engine::waitBeforeGraphics(const Timeline &timeline, uint64_t value, vk::PipelineStageFlags2 stage_mask)
+{
+    graphics_waits.push_back(Sync::submitInfo(timeline, value, stage_mask));
+}
+
+void Engine::recordLatency(std::chrono::high_resolution_clock::time_point input_time)
+{
+    if(!config.measure_latency){
+        return;
+    }
+
+    // Measured up to the return of presentKHR, i.e. the present submission, not the moment the image is displayed: the
+    // time spent in the presentation engine (one or more vblanks depending on the present mode and the queued images)
+    // comes on top of this
+    double latency = std::chrono::duration<double, std::chrono::milliseconds::period>(std::chrono::high_resolution_clock::now() - input_time).count();
+    latency_sum += latency;
+    latency_max = std::max(latency_max, latency);
+    latency_samples++;
+
+    if(latency_samples >= LATENCY_REPORT_SAMPLES){
+        std::cout << "Input to present submission latency (" << vk::to_string(swapchain.present_mode) << ", " << queue_pool.max_frames_in_flight
+                  << " frames in flight, " << swapchain.images.size() << " images): avg " << latency_sum / latency_samples
+                  << " ms, max " << latency_max << " ms" << std::endl;
+        latency_sum = 0.0;
+        latency_max = 0.0;
+        latency_samples = 0;
+    }
 }
 
 void Engine::processInput()
@@ -387,21 +722,66 @@ void Engine::processInput()
     }
 }
 
-void Engine::updateUniformBuffers(float dtime, int current_frame)
+JobHandle Engine::scheduleFrameJobs(float dtime)
 {
-    UniformBufferCamera ubo_camera;
+    JobHandle input_job = job_system.schedule([this](uint32_t){
+        processInput();
+    });
+    JobHandle update_job = job_system.schedule([this, dtime](uint32_t){
+        updateObjects(dtime);
+    }, {input_job});
+    return job_system.schedule([this, dtime](uint32_t){
+        prepareFrame(dtime);
+    }, {update_job});
+}
 
-    ubo_camera.view = camera.getViewMatrix();
-    ubo_camera.proj = camera.getProjectionMatrix(swapchain.extent.width * 1.f / swapchain.extent.height);
+void Engine::updateObjects(float dtime)
+{
+    for(size_t i = 0; i < objects.size(); i++){
+        objects[i].update(dtime);
+    }
+}
 
-    memcpy(ubo_camera_mapped[current_frame].data, &ubo_camera, sizeof(UniformBufferCamera));
+void Engine::prepareFrame(float dtime)
+{
+    frame_packet.camera.view = camera.getViewMatrix();
+    frame_packet.camera.proj = camera.getProjectionMatrix(swapchain.extent.width * 1.f / swapchain.extent.height);
 
-    UniformBufferGameObjects ubo_obj;
+    frame_packet.objects.resize(objects.size());
     for(size_t i = 0; i < objects.size(); i++){
-        objects[i].update(dtime);
-        ubo_obj.model = objects[i].getModelMat();
+        frame_packet.objects[i].model = objects[i].getModelMat();
+    }
+}
 
-        memcpy(ubo_objects_mapped[i][current_frame].data, &ubo_obj, sizeof(UniformBufferGameObjects));
+void Engine::updateUniformBuffers(int current_frame)
+{
+    FrameArena &arena = frame_arenas[current_frame];
+
+    ArenaAllocation camera_allocation = MemoryAllocator::arenaAllocate(arena, sizeof(UniformBufferCamera));
+    memcpy(camera_allocation.data, &frame_packet.camera, sizeof(UniformBufferCamera));
+
+    vk::DeviceSize objects_size = frame_packet.objects.size() * sizeof(UniformBufferGameObjects);
+    ArenaAllocation objects_allocation = MemoryAllocator::arenaAllocate(arena, objects_size);
+    memcpy(objects_allocation.data, frame_packet.objects.data(), objects_size);
+
+    // The arena alignment is a multiple of a mat4, the shader indexes the arena as an array of them
+    frame_heap_constants.arena_index = arena.heap_index;
+    frame_heap_constants.camera_matrix = static_cast<uint32_t>(camera_allocation.offset / sizeof(glm::mat4));
+    frame_heap_constants.objects_matrix = static_cast<uint32_t>(objects_allocation.offset / sizeof(glm::mat4));
+
+    // One indirect command per object drawing its mesh, its index as first instance selects its matrix in the shader
+    indirect_draws.clear();
+    for(const auto &[pipeline, pipeline_objects] : pip_to_obj){
+        ArenaAllocation commands_allocation = MemoryAllocator::arenaAllocate(arena, sizeof(vk::DrawIndexedIndirectCommand) * pipeline_objects.size());
+        vk::DrawIndexedIndirectCommand *commands = static_cast<vk::DrawIndexedIndirectCommand*>(commands_allocation.data);
+
+        IndirectDrawRange &draws = indirect_draws[pipeline];
+        draws.offset = commands_allocation.offset;
+        for(Gameobject *object : pipeline_objects){
+            if(object -> getMesh().index_count > 0){
+                commands[draws.count++] = MeshPool::drawCommand(object -> getMesh(), 1, static_cast<uint32_t>(object - objects.data()));
+            }
+        }
     }
 }
 
@@ -430,33 +810,23 @@ void Engine::recordCommandBuffer(uint32_t image_index)
     attachment_info.clearValue = clear_color;
 
     vk::RenderingInfo rendering_info{};
+    rendering_info.flags = vk::RenderingFlagBits::eContentsSecondaryCommandBuffers; // Draws are recorded in secondary buffers
     rendering_info.renderArea.offset = vk::Offset2D{0, 0};
     rendering_info.renderArea.extent = swapchain.extent;
     rendering_info.layerCount = 1;
     rendering_info.colorAttachmentCount = 1;
     rendering_info.pColorAttachments = &attachment_info;
 
+    vk::CommandBufferInheritanceRenderingInfo rendering_inheritance{};
+    rendering_inheritance.colorAttachmentCount = 1;
+    rendering_inheritance.pColorAttachmentFormats = &swapchain.format;
+    rendering_inheritance.rasterizationSamples = msaa_samples;
+
     command_buffer.beginRendering(rendering_info);
     if(raster_pipelines.size() <= 0){
         throw std::runtime_error("There are no raster pipelines that can be used!");
     }
-    command_buffer.setViewport(0, vk::Viewport(0.0f, 0.0f, static_cast<float>(swapchain.extent.width), static_cast<float>(swapchain.extent.height), 0.0f, 1.0f)); // What portion of the window to use
-    command_buffer.setScissor(0, vk::Rect2D(vk::Offset2D(0, 0), swapchain.extent)); // What portion of the image to use
-    for(size_t i = 0; i < raster_pipelines.size(); i++){
-        command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, *(raster_pipelines[i].pipeline));
-        command_buffer.setCullMode(raster_pipelines[i].cull_mode);
-        command_buffer.bindDescriptorSets(
-            vk::PipelineBindPoint::eGraphics,
-            raster_pipelines[i].layout,
-            0,
-            *raster_pipelines[i].descriptor_sets[current_frame],
-            {}
-        );
-        UniformBufferGameObjects ubo_obj;
-        command_buffer.bindVertexBuffers(0, pip_to_obj[&raster_pipelines[i]][0] -> getVertexBuffer(), {0});
-        command_buffer.bindIndexBuffer(pip_to_obj[&raster_pipelines[i]][0] -> getIndexBuffer(), 0, vk::IndexType::eUint32);
-        command_buffer.drawIndexed(pip_to_obj[&raster_pipelines[i]][0] -> getIndexSize(), objects.size(), 0, 0, 0);
-    }
+    recordPipelines(command_buffer, rendering_inheritance);
     command_buffer.endRendering();
 
     // After rendering, transition the swapchain image to PRESENT_SRC
@@ -477,20 +847,249 @@ void Engine::recordCommandBuffer(uint32_t image_index)
 
 }
 
+void Engine::recordPipelines(vk::raii::CommandBuffer &command_buffer, const vk::CommandBufferInheritanceRenderingInfo &rendering_inheritance)
+{
+    // Pipelines without objects nor batches, like the variants not selected this frame, are not recorded
+    auto has_objects = [this](RasterPipelineBundle *pipeline){
+        auto objects_it = pip_to_obj.find(pipeline);
+        return objects_it != pip_to_obj.end() && !objects_it -> second.empty();
+    };
+    std::vector<RasterPipelineBundle *> drawn_pipelines;
+    for(RasterPipelineBundle &pipeline : raster_pipelines){
+        bool has_batches = std::any_of(instanced_batches.begin(), instanced_batches.end(), [&pipeline](const auto &batch){
+            return batch.second.pipeline == &pipeline;
+        });
+        if(has_objects(&pipeline) || has_batches){
+            drawn_pipelines.push_back(&pipeline);
+        }
+    }
+    if(drawn_pipelines.empty()){
+        return;
+    }
+
+    std::vector<vk::CommandBuffer> secondary_buffers(drawn_pipelines.size());
+
+    // Each thread records with the pool it owns for the current frame
+    auto record = [this, &secondary_buffers, &drawn_pipelines, &rendering_inheritance, &has_objects](size_t pipeline_index, uint32_t thread_index){
+        ThreadCommandPool &thread_pool = queue_pool.thread_command_pools[current_frame][thread_index];
+        vk::raii::CommandBuffer &secondary = Device::getSecondaryCommandBuffer(thread_pool, logical_device);
+
+        vk::CommandBufferInheritanceInfo inheritance_info;
+        inheritance_info.pNext = &rendering_inheritance;
+
+        vk::CommandBufferBeginInfo begin_info;
+        begin_info.flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit | vk::CommandBufferUsageFlagBits::eRenderPassContinue;
+        begin_info.pInheritanceInfo = &inheritance_info;
+
+        secondary.begin(begin_info);
+        // Dynamic state is not inherited from the primary command buffer
+        secondary.setViewport(0, vk::Viewport(0.0f, 0.0f, static_cast<float>(swapchain.extent.width), static_cast<float>(swapchain.extent.height), 0.0f, 1.0f)); // What portion of the window to use
+        secondary.setScissor(0, vk::Rect2D(vk::Offset2D(0, 0), swapchain.extent)); // What portion of the image to use
+        if(has_objects(drawn_pipelines[pipeline_index])){
+            recordPipelineCommands(secondary, *drawn_pipelines[pipeline_index]);
+        }
+        recordBatchCommands(secondary, *drawn_pipelines[pipeline_index]);
+        secondary.end();
+
+        secondary_buffers[pipeline_index] = *secondary;
+    };
+
+    // The calling thread records the first pipeline while the workers take the others
+    std::vector<std::future<void>> recordings;
+    recordings.reserve(drawn_pipelines.size());
+    for(size_t i = 1; i < drawn_pipelines.size(); i++){
+        recordings.push_back(job_system.submit([&record, i](uint32_t thread_index){
+            record(i, thread_index);
+        }));
+    }
+    record(0, 0);
+    for(std::future<void> &recording : recordings){
+        recording.get();
+    }
+
+    command_buffer.executeCommands(secondary_buffers);
+}
+
+void Engine::recordPipelineCommands(vk::raii::CommandBuffer &command_buffer, RasterPipelineBundle &pipeline)
+{
+    command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, *(pipeline.pipeline));
+    command_buffer.setCullMode(pipeline.cull_mode);
+    // The heap is the same set for every frame, only the pushed arena and offsets change
+    descriptor_heap.bind(command_buffer, pipeline.layout);
+    command_buffer.pushConstants<HeapPushConstants>(pipeline.layout, vk::ShaderStageFlagBits::eVertex, 0, frame_heap_constants);
+    // Every mesh is in the pool buffers: a single bind and a single draw for all the objects of the pipeline
+    const IndirectDrawRange &draws = indirect_draws.at(&pipeline);
+    mesh_pool.bind(command_buffer);
+    command_buffer.drawIndexedIndirect(frame_arenas[current_frame].memory.buffer.buffer, draws.offset, draws.count, sizeof(vk::DrawIndexedIndirectCommand));
+}
+
+void Engine::recordBatchCommands(vk::raii::CommandBuffer &command_buffer, RasterPipelineBundle &pipeline)
+{
+    bool bound = false;
+    for(const auto &[batch_id, batch] : instanced_batches){
+        if(batch.pipeline != &pipeline || batch.instance_count == 0 || batch.mesh.index_count == 0){
+            continue;
+        }
+        // Rebound even after recordPipelineCommands, which may be overridden with other layouts
+        if(!bound){
+            command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, *(pipeline.pipeline));
+            command_buffer.setCullMode(pipeline.cull_mode);
+            descriptor_heap.bind(command_buffer, pipeline.layout);
+            bound = true;
+        }
+
+        BatchPushConstants push_constants{};
+        push_constants.view_proj = batch_view_proj;
+        push_constants.instance_count = batch.instance_count;
+        push_constants.stream_count = static_cast<uint32_t>(batch.streams.size());
+        for(size_t i = 0; i < batch.streams.size(); i++){
+            push_constants.streams[i] = batch.streams[i].heap_index;
+        }
+        command_buffer.pushConstants<BatchPushConstants>(pipeline.layout, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment, 0, push_constants);
+
+        mesh_pool.bind(command_buffer, batch.mesh.format);
+        command_buffer.drawIndexed(batch.mesh.index_count, batch.instance_count, batch.mesh.first_index, batch.mesh.first_vertex, 0);
+    }
+}
+
+glm::mat4 Engine::getViewProjection()
+{
+    return frame_packet.camera.proj * frame_packet.camera.view;
+}
+
+// --- INSTANCED BATCHES ---
+
+void Engine::prepareBatchRequest(RasterPipelineRequest &request)
+{
+    request.shared_set_layout = *descriptor_heap.getLayout();
+    request.push_constant_ranges = {vk::PushConstantRange(vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment, 0, sizeof(BatchPushConstants))};
+}
+
+uint32_t Engine::createInstancedBatch(const std::string &name, RasterPipelineBundle &pipeline, const MeshAllocation &mesh, const std::vector<uint32_t> &stream_strides)
+{
+    if(stream_strides.size() > MAX_INSTANCE_STREAMS){
+        throw std::runtime_error("Instanced batch " + name + " has " + std::to_string(stream_strides.size()) + " streams, the maximum is " + std::to_string(MAX_INSTANCE_STREAMS));
+    }
+
+    InstancedBatch batch;
+    batch.name = name;
+    batch.pipeline = &pipeline;
+    batch.mesh = mesh;
+    batch.streams.resize(stream_strides.size());
+    for(size_t i = 0; i < stream_strides.size(); i++){
+        batch.streams[i].stride = stream_strides[i];
+    }
+
+    uint32_t batch_id = next_batch_id++;
+    instanced_batches.emplace(batch_id, std::move(batch));
+    return batch_id;
+}
+
+void Engine::writeInstanceStream(uint32_t batch_id, uint32_t stream_index, const void *data, uint32_t count)
+{
+    InstancedBatch &batch = instanced_batches.at(batch_id);
+    InstanceStream &stream = batch.streams.at(stream_index);
+    vk::DeviceSize size = vk::DeviceSize(stream.stride) * count;
+
+    // Frames in flight keep reading the previous buffer through its slot
+    retireInstanceStream(stream);
+
+    stream.buffer.buffer = Device::createDirectWriteBuffer(std::max<vk::DeviceSize>(size, stream.stride), vk::BufferUsageFlagBits::eStorageBuffer,
+                                                           batch.name + " stream " + std::to_string(stream_index), vma_allocator);
+    stream.buffer.data = stream.buffer.buffer.info.pMappedData;
+    if(size > 0){
+        if(stream.buffer.data){
+            memcpy(stream.buffer.data, data, size);
+            Device::flushBuffer(stream.buffer.buffer);
+        }
+        else{
+            AllocatedBuffer staging = Device::createBuffer(
+                size,
+                vk::BufferUsageFlagBits::eTransferSrc,
+                vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+                "Instance stream staging",
+                vma_allocator,
+                MemoryClass::Staging
+            );
+            memcpy(staging.info.pMappedData, data, size);
+            // Copied on the graphics queue: the stream buffer is exclusive to the graphics family that draws it, a copy on
+            // a dedicated transfer family would need an ownership transfer
+            vk::raii::CommandBuffer command_buffer = Device::beginSingleTimeCommands(queue_pool.graphics_command_pool, logical_device);
+            command_buffer.copyBuffer(staging.buffer, stream.buffer.buffer.buffer, vk::BufferCopy(0, 0, size));
+            Device::endSingleTimeCommands(command_buffer, queue_pool.graphics_queue);
+        }
+    }
+    stream.count = count;
+    stream.heap_index = descriptor_heap.addStorageBuffer(stream.buffer.buffer.buffer);
+
+    batch.instance_count = std::min_element(batch.streams.begin(), batch.streams.end(), [](const InstanceStream &a, const InstanceStream &b){
+        return a.count < b.count;
+    }) -> count;
+}
+
+void Engine::destroyInstancedBatch(uint32_t batch_id)
+{
+    auto batch_it = instanced_batches.find(batch_id);
+    if(batch_it == instanced_batches.end()){
+        return;
+    }
+    for(InstanceStream &stream : batch_it -> second.streams){
+        retireInstanceStream(stream);
+    }
+    instanced_batches.erase(batch_it);
+}
+
+void Engine::retireInstanceStream(InstanceStream &stream)
+{
+    // Never written: nothing to retire, and the deletion queues may not exist yet during createInitResources
+    if(stream.heap_index == DescriptorHeap::INVALID_INDEX){
+        return;
+    }
+    uint32_t heap_index = stream.heap_index;
+    deletion_queues[current_frame].push([this, heap_index](){
+        descriptor_heap.release(DescriptorHeap::STORAGE_BUFFER_BINDING, heap_index);
+    });
+    retireResource(stream.buffer);
+    stream.heap_index = DescriptorHeap::INVALID_INDEX;
+    stream.count = 0;
+}
+
 // --- CLOSING FUNCTIONS ---
 
 void Engine::cleanup(){
     std::cout << "\nCLEANING UP RESOURCES..." << std::endl;
+    shader_watcher.stop();
+    job_system.stop();
+    reload_jobs.stop();
+    shader_reloads.clear(); // Completed by stop(), the rebuilt pipelines are dropped
+
+    // Saved on exit so that it also holds the pipelines created at runtime
+    Pipeline::savePipelineCache(pipeline_cache, physical_device, pipeline_cache_path);
+    pipeline_cache = nullptr;
+    ShaderCache::clear();
+
+    // Their meshes are retired in the deletion queues
+    objects.clear();
+
+    // The device is idle at this point, every retired resource can go
+    for(DeletionQueue &deletion_queue : deletion_queues){
+        deletion_queue.flush();
+    }
+
     // Destroying the images -> this is needed since we need to destroy the allocator
     color_image.~AllocatedImage();
     depth_image.~AllocatedImage();
 
-    // Destroying the gameobject buffers
-    objects.clear();
-    ubo_camera_mapped.clear();
-    ubo_objects_mapped.clear();
+    // Destroying the instance streams
+    instanced_batches.clear();
+    mesh_pool.destroy();
+    for(FrameArena &arena : frame_arenas){
+        std::cout << arena.memory.buffer.name << " peak usage: " << arena.peak << "/" << arena.capacity << " bytes" << std::endl;
+    }
+    frame_arenas.clear();
+    descriptor_heap.destroy();
     
 
-    // Destroying the allocator
-    vmaDestroyAllocator(vma_allocator);
+    // Destroying the pools and the allocator
+    MemoryAllocator::destroyMemoryAllocator(vma_allocator);
 }
\ No newline at end of file
@@ -10,6 +10,11 @@
 #include "pipeline.hpp"
 #include "gameobject.hpp"
 #include "camera.hpp"
+#include "jobs.hpp"
+#include "sync.hpp"
+#include "shaders.hpp"
+#include "descriptors.hpp"
+#include "meshes.hpp"
 
 
 
@@ -25,11 +30,37 @@ constexpr bool enable_val_layers = true;
 
 
 
+// Data produced by the update jobs of a frame and consumed by the render thread
+struct FramePacket{
+    UniformBufferCamera camera;
+    std::vector<UniformBufferGameObjects> objects;
+};
+
+
+// Pipeline rebuilt with a recompiled shader, swapped in by the render thread
+struct ReloadedPipeline{
+    RasterPipelineBundle *bundle = nullptr;
+    vk::raii::Pipeline pipeline = nullptr;
+    std::shared_ptr<vk::raii::ShaderModule> v_shader;
+    std::shared_ptr<vk::raii::ShaderModule> f_shader;
+    double build_ms = 0.0;
+};
+
+// Result of a background shader recompilation
+struct ShaderReload{
+    std::string source;
+    bool compiled = false;
+    double compile_ms = 0.0;
+    std::string log; // Compiler and pipeline creation errors
+    std::vector<ReloadedPipeline> pipelines;
+};
+
+
 class Engine{
 public:
 
     // Entry point of the engine. Initialize window and Vulkan components
-    void init(const std::string title, uint32_t &w, uint32_t &h);
+    void init(const std::string title, uint32_t &w, uint32_t &h, const EngineConfig &config = EngineConfig());
     
     // Closing functions: cleans the non-raii resources
     virtual void cleanup();
@@ -38,11 +69,15 @@ public:
     void run();
 
 protected:
+    EngineConfig config;
+    JobSystem job_system;
+
     // Window variables
     GLFWwindow * window;
     std::string title;
     uint32_t win_width;
     uint32_t win_height;
+    bool framebuffer_resized = false; // Set by the GLFW callback, the swapchain is recreated on the next present
 
     // Instance variables
     vk::raii::Context context;
@@ -64,6 +99,8 @@ protected:
 
     // Memory allocator components
     VmaAllocator vma_allocator;
+    std::string memory_report_path = "memory_report.jsonl";
+    bool memory_report_started = false; // The first report of a run truncates the file
 
     // Images components
     vk::SampleCountFlagBits msaa_samples = vk::SampleCountFlagBits::e1;
@@ -71,25 +108,52 @@ protected:
     AllocatedImage depth_image;
 
     // Pipeline components
+    vk::raii::PipelineCache pipeline_cache = nullptr; // Shared by every pipeline creation, persisted across runs
+    std::string pipeline_cache_path = "pipeline_cache.bin";
+    size_t pipeline_cache_loaded = 0; // Bytes loaded from disk, 0 for a cold start
     std::vector<RasterPipelineBundle> raster_pipelines;
+    ShaderWatcher shader_watcher;
+    std::vector<std::future<ShaderReload>> shader_reloads; // Recompilations running on reload_jobs
+    // Dedicated thread for the recompilations: a glslc run must never delay the frame jobs and the recording on
+    // job_system, which a shared worker (or no worker at all) would do
+    JobSystem reload_jobs;
+    DescriptorHeap descriptor_heap; // Bindless set shared by the pipelines created with its layout
+    std::vector<FrameArena> frame_arenas; // [frame] per-frame data (camera, object matrices), reset when the frame is reused
+    const vk::DeviceSize FRAME_ARENA_SIZE = 1 << 20;
+    HeapPushConstants frame_heap_constants; // Where the sample data of the frame being recorded was written in its arena
+    MeshPool mesh_pool; // Vertices and indices of every object
     std::vector<Gameobject> objects;
-    std::vector<std::vector<MappedUBO>> ubo_objects_mapped;
     std::map<RasterPipelineBundle *, std::vector<Gameobject *>> pip_to_obj; // This allows me to connect all the objects using the same pipeline
+    std::map<RasterPipelineBundle *, IndirectDrawRange> indirect_draws; // Commands of the frame being recorded, one per object with a mesh
+    std::map<uint32_t, InstancedBatch> instanced_batches; // [batch id]
+    uint32_t next_batch_id = 0;
+    glm::mat4 batch_view_proj; // Camera of the frame being recorded, pushed with every batch
 
     // Synchronization components
     uint32_t current_frame = 0;
     std::vector<vk::raii::Semaphore> present_complete_semaphores; // Used to synchronize the images being actually displayed
     uint32_t present_semaphore_index = 0;
     std::vector<vk::raii::Semaphore> render_finished_semaphores; // Used to synchronize operations on frames by the GPU before presenting them
-    std::vector<vk::raii::Fence> in_flight_fences; // Used to synchronize operations on the CPU
+    std::vector<uint64_t> frame_timeline_values; // Graphics timeline value signaled by the last submission of each frame
+    std::vector<vk::SemaphoreSubmitInfo> graphics_waits; // Timeline values of other queues the next frame submission waits for
+    std::vector<DeletionQueue> deletion_queues; // Resources retired during a frame, released when its timeline value is waited again
 
     // FPS tracker components
     float time = 0.0;
     std::chrono::_V2::system_clock::time_point prev_time; 
 
+    // Frame jobs components
+    FramePacket frame_packet; // Written by the frame jobs, read by the render thread once they completed
+
+    // Latency tracker components
+    std::optional<std::chrono::high_resolution_clock::time_point> pending_input_time; // Oldest input not yet consumed by a frame
+    double latency_sum = 0.0;
+    double latency_max = 0.0;
+    uint32_t latency_samples = 0;
+    const uint32_t LATENCY_REPORT_SAMPLES = 30;
+
     // Camera components
     Camera camera;
-    std::vector<MappedUBO> ubo_camera_mapped;
 
     // Input variables
     std::map<int, InputState> inputs;
@@ -113,6 +177,16 @@ protected:
     // Gets GLFW extensions for Vulkan and necessary extensions for debugging
     std::vector<const char *> getRequiredExtensions();
 
+    // Prints the memory report and appends it to the JSON dump. Overridden to add scene specific CPU containers
+    virtual void reportMemory(const std::string &label);
+
+    // Hands a buffer, image, pipeline, ... to the deletion queue of the current frame instead of destroying it on the spot.
+    // The resource is left empty and can be reassigned immediately
+    template<typename T>
+    void retireResource(T &resource){
+        deletion_queues[current_frame].retire(resource);
+    }
+
 
     // --- INITIALIZATION FUNCTIONS ---
 
@@ -127,27 +201,116 @@ protected:
     void createSurface();
     // Initializes Pipelines and scene objects
     virtual void createInitResources();
+    // Creates one frame arena per frame in flight and registers them in the descriptor heap
+    void createFrameArenas();
     // Initializes Synchronization objects
     void createSyncObjects();
+    // Creates the semaphores indexed by swapchain image
+    void createSwapchainSemaphores();
+    // Creates the color and depth attachments matching the swapchain extent
+    void createAttachments();
+    // Builds shader modules and pipeline of a request on a worker, sharing the pipeline cache. Lets pipelines compile
+    // concurrently with each other and with the rest of the resource creation
+    std::future<RasterPipelineBundle> buildRasterPipeline(RasterPipelineRequest request);
+    // Starts recompiling the modified shaders and swaps in the pipelines rebuilt by the completed recompilations.
+    // Called at the start of a frame, when no recording is running
+    void updateShaderReloads();
+    // Job: compiles source to SPIR-V and rebuilds the given pipelines with it. Errors are reported, never thrown,
+    // so a broken shader keeps the previous pipeline
+    ShaderReload reloadShader(const std::string &source, const std::vector<RasterPipelineBundle *> &bundles);
+    // Prints the time spent compiling the pipelines created at startup, with the state of the pipeline cache
+    void reportPipelineStartup(double init_resources_ms);
 
 
     // --- RUN FUNCTIONS ---
 
-    // Function meant to update Uniform Buffer
-    virtual void updateUniformBuffers(float dtime, int current_frame);
+    // Schedules the CPU work of a frame: input -> object update -> frame packet preparation.
+    // Returns the last job, the render thread waits for it before uploading the packet
+    JobHandle scheduleFrameJobs(float dtime);
+
+    // Frame job: advances the simulation of the objects
+    virtual void updateObjects(float dtime);
+
+    // Frame job: fills the frame packet with the data the GPU needs this frame
+    virtual void prepareFrame(float dtime);
+
+    // Function meant to update Uniform Buffer. Copies the completed frame packet into the buffers of the frame
+    virtual void updateUniformBuffers(int current_frame);
+
+    // Records the compute work of the frame and submits it to the compute queue, before the graphics submission waiting for it
+    void submitComputeCommands();
+
+    // Records the compute work of a frame (culling, light binning, ...). Returns the graphics stages consuming its results,
+    // none if nothing was recorded. With a dedicated compute family, exclusive resources shared with graphics need an
+    // ownership transfer (Device::bufferBarrier)
+    virtual vk::PipelineStageFlags2 recordComputeCommands(vk::raii::CommandBuffer &command_buffer);
+
+    // Whether the frame has compute work to record. False by default: the command buffer is then left untouched
+    virtual bool hasComputeWork();
 
     // Main functions to register commands to the GPU
     virtual void recordCommandBuffer(uint32_t image_index);
 
+    // Records every raster pipeline into its own secondary command buffer, spread over the job system workers,
+    // and executes them in command_buffer. Must be called inside a rendering started with eContentsSecondaryCommandBuffers
+    void recordPipelines(vk::raii::CommandBuffer &command_buffer, const vk::CommandBufferInheritanceRenderingInfo &rendering_inheritance);
+
+    // Records the draw commands of a single pipeline and its objects. Called concurrently from different threads,
+    // so it must only read shared state
+    virtual void recordPipelineCommands(vk::raii::CommandBuffer &command_buffer, RasterPipelineBundle &pipeline);
+
+    // Records the instanced batches drawn by a pipeline. Called concurrently from different threads, like recordPipelineCommands
+    void recordBatchCommands(vk::raii::CommandBuffer &command_buffer, RasterPipelineBundle &pipeline);
+
+    // Camera pushed with the instanced batches. Overridden by the scenes computing their own projection
+    virtual glm::mat4 getViewProjection();
+
     // main function for rendering
     void drawFrame();
 
+    // Recreates swapchain, attachments and per-image semaphores after a resize. The old ones are retired
+    // through the deletion queue instead of idling the device
+    void recreateSwapchain();
+
+    // Flags the swapchain as out of date when the framebuffer changes size
+    static void framebufferResizeCallback(GLFWwindow *window, int width, int height);
+
     // Input function. Maps inputs to a dictionary for later usage
     static void recordInput(GLFWwindow *window, int key, int scancode, int action, int mods);
 
-    // Actual function that process keyboard input accordingly
+    // Actual function that process keyboard input accordingly. Runs as a frame job, after glfwPollEvents returned
     virtual void processInput();
 
+    // Makes the next frame submission wait on the GPU until the timeline of another queue (uploads, async compute) reaches value
+    void waitBeforeGraphics(const Timeline &timeline, uint64_t value, vk::PipelineStageFlags2 stage_mask);
+
+    // Records the input to present submission latency of a frame that consumed input, printing statistics every LATENCY_REPORT_SAMPLES samples
+    void recordLatency(std::chrono::high_resolution_clock::time_point input_time);
+
+    // --- INSTANCED BATCHES ---
+    // Any number of instances of a pool mesh, with per-instance data in streams (one buffer per attribute). The engine
+    // uploads the streams, registers them in the descriptor heap and draws every batch with its pipeline
+
+    // Sets the descriptor heap layout and the BatchPushConstants range used by every batch pipeline. Its vertex shader
+    // reads stream i from the heap at batch.streams[i], indexed with gl_InstanceIndex
+    void prepareBatchRequest(RasterPipelineRequest &request);
+
+    // Registers a batch drawing a mesh of the pool with pipeline, with one stream per stride (at most MAX_INSTANCE_STREAMS).
+    // Nothing is drawn until the streams are written. Returns the id of the batch
+    uint32_t createInstancedBatch(const std::string &name, RasterPipelineBundle &pipeline, const MeshAllocation &mesh, const std::vector<uint32_t> &stream_strides);
+
+    // Replaces the content of a stream with count elements. The new buffer is written in place on host visible device
+    // local memory, copied from a staging buffer on the graphics queue otherwise. The previous buffer and heap slot are retired, so it is
+    // meant for data changing occasionally; per-frame data belongs to the frame arena. The batch draws as many instances
+    // as its shortest stream
+    void writeInstanceStream(uint32_t batch_id, uint32_t stream_index, const void *data, uint32_t count);
+
+    // Removes a batch. Its buffers and heap slots are released once the frames drawing it completed
+    void destroyInstancedBatch(uint32_t batch_id);
+
+    // Retires the buffer of a stream and releases its heap slot once the current frame completed
+    void retireInstanceStream(InstanceStream &stream);
+
     // --- CLOSING FUNCTIONS ---
 
 };
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "../Helpers/GeneralLibraries.hpp"
 
 #include "device.hpp"
+#include "meshes.hpp"
 
 class Gameobject{
 public:
@@ -22,7 +23,10 @@ public:
         this -> scale_speed = scale_speed;
     }
 
-    ~Gameobject() = default;
+    // The mesh ranges go back to the pool once the frames drawing them completed
+    virtual ~Gameobject(){
+        retireMesh();
+    }
 
     // Delete Copying
     Gameobject(const Gameobject&) = delete;
@@ -31,24 +35,30 @@ public:
     // Enable moving
     Gameobject(Gameobject&& other) noexcept 
         : vertices(std::move(other.vertices)), 
-          vertex_buffer(std::move(other.vertex_buffer)),
           indices(std::move(other.indices)),
-          index_buffer(std::move(other.index_buffer)),
+          mesh(other.mesh),
+          mesh_pool(other.mesh_pool),
+          vertex_format(other.vertex_format),
           position(other.position),
           rotation(other.rotation),
           scale(other.scale),
           dis_speed(other.dis_speed),
           rot_speed(other.rot_speed),
           scale_speed(other.scale_speed) {
+        other.mesh = MeshAllocation();
+        other.mesh_pool = nullptr;
     }
 
     Gameobject& operator=(Gameobject&& other) noexcept {
         if (this != &other) {
+            retireMesh();
             vertices = std::move(other.vertices);
-            vertex_buffer = std::move(other.vertex_buffer);
-
             indices = std::move(other.indices);
-            index_buffer = std::move(other.index_buffer);
+            mesh = other.mesh;
+            mesh_pool = other.mesh_pool;
+            vertex_format = other.vertex_format;
+            other.mesh = MeshAllocation();
+            other.mesh_pool = nullptr;
 
             position = other.position;
             scale = other.scale;
@@ -61,9 +71,17 @@ public:
     }
 
 
-    // Initializes the object
-    virtual void start(VmaAllocator& vma_allocator, vk::raii::Device& logical_device, QueuePool& queue_pool){
-        loadBuffers(vma_allocator, logical_device, queue_pool);
+    // Initializes the object, uploading its mesh in the shared pool
+    virtual void start(MeshPool &mesh_pool, VmaAllocator& vma_allocator, vk::raii::Device& logical_device, QueuePool& queue_pool){
+        retireMesh();
+        mesh = mesh_pool.upload(vertices, indices, vertex_format, vma_allocator, logical_device, queue_pool);
+        this -> mesh_pool = &mesh_pool;
+    }
+
+    // Layout of the vertices in the mesh pool, must match the vertex format of the pipelines drawing the object.
+    // Only effective before start
+    void setVertexFormat(VertexFormat format){
+        vertex_format = format;
     }
 
     // Updates the object
@@ -95,12 +113,9 @@ public:
         return indices.size();
     }
 
-    const vk::Buffer& getVertexBuffer(){
-        return vertex_buffer.buffer;
-    }
-
-    const vk::Buffer& getIndexBuffer(){
-        return index_buffer.buffer;
+    // Offsets of the object geometry in the mesh pool buffers
+    const MeshAllocation &getMesh(){
+        return mesh;
     }
 
     virtual const glm::mat4 &getModelMat(){
@@ -125,9 +140,10 @@ public:
 
 protected:
     std::vector<Vertex> vertices;
-    AllocatedBuffer vertex_buffer;
     std::vector<uint32_t> indices;
-    AllocatedBuffer index_buffer;
+    MeshAllocation mesh;
+    MeshPool *mesh_pool = nullptr; // Pool holding the mesh, set by start
+    VertexFormat vertex_format = VertexFormat::Full;
 
     // Spatial information
     glm::vec3 position;
@@ -141,30 +157,13 @@ protected:
     glm::vec3 rot_speed; // Rotational speed
     glm::vec3 scale_speed; // Scale change speed
 
-    // loads the necessary buffers for the object
-    void loadBuffers(VmaAllocator &vma_allocator, vk::raii::Device &logical_device, QueuePool &queue_pool){
-        vk::DeviceSize vertex_size = sizeof(Vertex) * vertices.size();
-        vk::DeviceSize index_size = sizeof(uint32_t) * indices.size();
-        vk::DeviceSize total_size = vertex_size + index_size;
-
-        AllocatedBuffer staging_buffer = Device::createBuffer(total_size, vk::BufferUsageFlagBits::eTransferSrc,
-            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, "vertex+indices staging buffer", vma_allocator);
-
-        void * data;
-        vmaMapMemory(vma_allocator, staging_buffer.allocation, &data);
-        memcpy(data, vertices.data(), (size_t)vertex_size);
-        memcpy((char *)data + vertex_size, indices.data(), (size_t)index_size);
-        vmaUnmapMemory(vma_allocator, staging_buffer.allocation);
-
-        vertex_buffer = Device::createBuffer(vertex_size, vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer,
-            vk::MemoryPropertyFlagBits::eDeviceLocal, "vertex buffer", vma_allocator);
-
-        Device::copyBuffer(staging_buffer, vertex_buffer, vertex_size, logical_device, queue_pool, 0);
-
-        index_buffer = Device::createBuffer(index_size, vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eIndexBuffer,
-            vk::MemoryPropertyFlagBits::eDeviceLocal, "index buffer", vma_allocator);
-
-        Device::copyBuffer(staging_buffer, index_buffer, index_size, logical_device, queue_pool, vertex_size);
+private:
+    // Hands the mesh back to its pool through the pool deferral, leaving the object without one
+    void retireMesh(){
+        if(mesh_pool){
+            mesh_pool -> retire(mesh);
+        }
+        mesh = MeshAllocation();
+        mesh_pool = nullptr;
     }
-
 };
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "image.hpp"
+#include "memory.hpp"
 
 AllocatedImage Image::createImage(uint32_t width, uint32_t height, vk::ImageType image_type, uint32_t mip_levels, 
     vk::SampleCountFlagBits msaa_samples, vk::Format format, uint32_t array_layers, vk::ImageTiling tiling, 
@@ -49,6 +50,7 @@ AllocatedImage Image::createImage(uint32_t width, uint32_t height, vk::ImageType
         image.image = VK_NULL_HANDLE; // Ensure handle is null on failure
     }else{
         image.image = vk::Image(temp_image);
+        MemoryAllocator::trackAllocation(vma_allocator, image.allocation, image_name);
     }
 
     std::cout << "Created Image:\n" << image.to_str() << std::endl;
@@ -0,0 +1,126 @@
+#include "jobs.hpp"
+
+void JobSystem::start(uint32_t worker_count)
+{
+    stop();
+    stopping = false;
+
+    workers.reserve(worker_count);
+    for(uint32_t i = 0; i < worker_count; i++){
+        workers.emplace_back(&JobSystem::workerLoop, this, i + 1);
+    }
+
+    std::cout << "Started job system with " << worker_count << " worker threads" << std::endl;
+}
+
+void JobSystem::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(tasks_mutex);
+        stopping = true;
+    }
+    tasks_cv.notify_all();
+
+    for(std::thread &worker : workers){
+        if(worker.joinable()){
+            worker.join();
+        }
+    }
+    workers.clear();
+}
+
+JobHandle JobSystem::schedule(std::function<void(uint32_t)> task, const std::vector<JobHandle> &dependencies)
+{
+    JobHandle job = std::make_shared<Job>();
+    job -> task = std::move(task);
+    // One extra count guards against the dependencies finishing while they are still being registered
+    job -> pending_dependencies = static_cast<uint32_t>(dependencies.size()) + 1;
+
+    for(const JobHandle &dependency : dependencies){
+        std::lock_guard<std::mutex> lock(dependency -> mutex);
+        if(dependency -> finished){
+            job -> pending_dependencies--;
+        }
+        else{
+            dependency -> dependents.push_back(job);
+        }
+    }
+
+    if(--(job -> pending_dependencies) == 0){
+        enqueue([this, job](uint32_t thread_index){
+            run(job, thread_index);
+        });
+    }
+
+    return job;
+}
+
+void JobSystem::wait(const JobHandle &job)
+{
+    if(job){
+        job -> future.get();
+    }
+}
+
+bool JobSystem::isDone(const JobHandle &job)
+{
+    return !job || job -> future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void JobSystem::enqueue(std::function<void(uint32_t)> task)
+{
+    if(workers.empty()){
+        task(0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(tasks_mutex);
+        tasks.push_back(std::move(task));
+    }
+    tasks_cv.notify_one();
+}
+
+void JobSystem::run(const JobHandle &job, uint32_t thread_index)
+{
+    try{
+        job -> task(thread_index);
+        job -> promise.set_value();
+    }
+    catch(...){
+        job -> promise.set_exception(std::current_exception());
+    }
+
+    std::vector<JobHandle> dependents;
+    {
+        std::lock_guard<std::mutex> lock(job -> mutex);
+        job -> finished = true;
+        dependents.swap(job -> dependents);
+    }
+
+    for(const JobHandle &dependent : dependents){
+        if(--(dependent -> pending_dependencies) == 0){
+            enqueue([this, dependent](uint32_t index){
+                run(dependent, index);
+            });
+        }
+    }
+}
+
+void JobSystem::workerLoop(uint32_t thread_index)
+{
+    while(true){
+        std::function<void(uint32_t)> task;
+        {
+            std::unique_lock<std::mutex> lock(tasks_mutex);
+            tasks_cv.wait(lock, [this](){ return stopping || !tasks.empty(); });
+            if(tasks.empty()){
+                return; // stopping and nothing left to do
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+
+        task(thread_index);
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "../Helpers/GeneralLibraries.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <type_traits>
+
+// A scheduled task with its dependency bookkeeping
+struct Job{
+    std::function<void(uint32_t)> task;
+    std::atomic<uint32_t> pending_dependencies{0};
+
+    std::mutex mutex; // Protects dependents and finished
+    std::vector<std::shared_ptr<Job>> dependents; // Jobs released when this one finishes
+    bool finished = false;
+
+    std::promise<void> promise;
+    std::shared_future<void> future = promise.get_future().share();
+};
+
+// Handle to a scheduled job, used to express dependencies and to wait for completion
+using JobHandle = std::shared_ptr<Job>;
+
+// Pool of worker threads executing tasks. Every task receives the index of the thread running it, so that
+// per-thread resources (command pools, scratch memory, ...) can be used without locking.
+// Index 0 is reserved for the thread owning the JobSystem, workers go from 1 to getWorkerCount()
+class JobSystem{
+public:
+    JobSystem() = default;
+    ~JobSystem(){
+        stop();
+    }
+
+    // Disable copying and moving, workers keep a pointer to the system
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    // Starts worker_count threads. 0 keeps every task on the calling thread
+    void start(uint32_t worker_count);
+
+    // Finishes the queued tasks and joins the workers
+    void stop();
+
+    // Schedules a task on the workers, the future holds its result or exception.
+    // Runs it immediately on the calling thread (index 0) when there are no workers
+    template<typename F>
+    auto submit(F task) -> std::future<std::invoke_result_t<F, uint32_t>>{
+        using Result = std::invoke_result_t<F, uint32_t>;
+
+        // packaged_task is move only, shared ownership lets it live inside a std::function
+        auto packaged = std::make_shared<std::packaged_task<Result(uint32_t)>>(std::move(task));
+        std::future<Result> future = packaged -> get_future();
+
+        enqueue([packaged](uint32_t thread_index){
+            (*packaged)(thread_index); // exceptions are stored in the future
+        });
+
+        return future;
+    }
+
+    // Schedules a task that starts only once all its dependencies have finished. Jobs never block a worker
+    // waiting for each other: a job is queued by the last dependency completing. A failing dependency doesn't
+    // cancel its dependents, the exception is only rethrown by wait() on the failed job
+    JobHandle schedule(std::function<void(uint32_t)> task, const std::vector<JobHandle> &dependencies = {});
+
+    // Blocks until the job has finished, rethrowing its exception if any
+    static void wait(const JobHandle &job);
+
+    // Returns true if the job has finished, without blocking
+    static bool isDone(const JobHandle &job);
+
+    uint32_t getWorkerCount() const{
+        return static_cast<uint32_t>(workers.size());
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void(uint32_t)>> tasks;
+    std::mutex tasks_mutex;
+    std::condition_variable tasks_cv;
+    bool stopping = false;
+
+    // Loop run by every worker
+    void workerLoop(uint32_t thread_index);
+
+    // Pushes a callable to the workers, or runs it on the calling thread if there are none
+    void enqueue(std::function<void(uint32_t)> task);
+
+    // Runs a job whose dependencies are complete, then releases its dependents
+    void run(const JobHandle &job, uint32_t thread_index);
+};
@@ -1,10 +1,113 @@
 #include "memory.hpp"
+#include "device.hpp"
 
 #ifndef VMA_IMPLEMENTATION
 #define VMA_IMPLEMENTATION
 #include "../Helpers/vk_mem_alloc.h"
 #endif
 
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <iomanip>
+
+// Information kept for every named allocation, used only for reporting
+struct TrackedAllocation{
+    std::string name;
+    vk::DeviceSize size = 0;
+    uint32_t memory_type = 0;
+    uint32_t heap = 0;
+    bool device_local = false;
+    bool host_visible = false;
+};
+
+// Allocations grouped by name and memory type for the report: buffers sharing a name may land in different heaps
+// (e.g. direct write buffers falling back to device local only memory)
+struct AllocationGroup{
+    uint32_t heap = 0;
+    uint32_t count = 0;
+    vk::DeviceSize size = 0;
+    bool device_local = false;
+    bool host_visible = false;
+};
+
+static std::mutex tracked_mutex;
+static std::map<VmaAllocation, TrackedAllocation> tracked_allocations;
+
+// How the pool of a memory class is created. The buffer usage and allocation flags only select its memory type
+struct PoolConfig{
+    const char *name;
+    VkBufferUsageFlags usage;
+    VmaMemoryUsage memory_usage;
+    VmaAllocationCreateFlags allocation_flags;
+    VmaPoolCreateFlags pool_flags;
+    VkDeviceSize block_size;
+};
+
+// [MemoryClass]. Linear pools suit buffers released in creation order (staging) or never released (frame arenas),
+// the default TLSF algorithm the ones freed in any order. VMA 3 has no buddy algorithm anymore
+static const std::array<PoolConfig, static_cast<size_t>(MemoryClass::Count)> pool_configs = {{
+    {"default", 0, VMA_MEMORY_USAGE_AUTO, 0, 0, 0},
+    {"staging", VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_AUTO,
+     VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT,
+     VMA_POOL_CREATE_LINEAR_ALGORITHM_BIT, 64ull << 20},
+    {"instance", VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_AUTO_PREFER_DEVICE,
+     VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_ALLOW_TRANSFER_INSTEAD_BIT,
+     0, 64ull << 20},
+    {"uniform", VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VMA_MEMORY_USAGE_AUTO,
+     VMA_ALLOCATION_CREATE_MAPPED_BIT | VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT,
+     VMA_POOL_CREATE_LINEAR_ALGORITHM_BIT, 8ull << 20},
+    {"geometry", VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_AUTO,
+     0, 0, 32ull << 20}
+}};
+
+static std::array<VmaPool, static_cast<size_t>(MemoryClass::Count)> pools{}; // [MemoryClass], nullptr for the default class
+static std::array<std::atomic<uint32_t>, static_cast<size_t>(MemoryClass::Count)> pool_fallbacks{};
+
+// Helper to print byte sizes in MiB
+static std::string toMiB(uint64_t bytes){
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2) << bytes / (1024.0 * 1024.0) << " MiB";
+    return ss.str();
+}
+
+// Helper to keep names valid inside JSON strings
+static std::string jsonEscape(const std::string &s){
+    std::string out;
+    out.reserve(s.size());
+    for(char c : s){
+        if(c == '"' || c == '\\'){
+            out.push_back('\\');
+            out.push_back(c);
+        }
+        else if(static_cast<unsigned char>(c) < 0x20){
+            // Control characters are not allowed raw in JSON strings
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+            out += escaped;
+        }
+        else{
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+// [name, memory type]
+static std::map<std::pair<std::string, uint32_t>, AllocationGroup> groupAllocations(){
+    std::lock_guard<std::mutex> lock(tracked_mutex);
+    std::map<std::pair<std::string, uint32_t>, AllocationGroup> groups;
+    for(const auto &[allocation, tracked] : tracked_allocations){
+        AllocationGroup &group = groups[{tracked.name, tracked.memory_type}];
+        group.heap = tracked.heap;
+        group.count++;
+        group.size += tracked.size;
+        group.device_local = tracked.device_local;
+        group.host_visible = tracked.host_visible;
+    }
+    return groups;
+}
+
 VmaAllocator MemoryAllocator::createMemoryAllocator(const vk::raii::PhysicalDevice &physical_device, const vk::raii::Device &logical_device, const vk::raii::Instance &instance)
 {
     VmaAllocatorCreateInfo allocator_info{};
@@ -20,6 +123,250 @@ VmaAllocator MemoryAllocator::createMemoryAllocator(const vk::raii::PhysicalDevi
         throw std::runtime_error("vmaCreateAllocator failed");
     }
 
+    for(size_t i = 1; i < pool_configs.size(); i++){
+        const PoolConfig &config = pool_configs[i];
+
+        VkBufferCreateInfo buffer_info = {VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO};
+        buffer_info.size = 1024; // Only used to find the memory type
+        buffer_info.usage = config.usage;
+        VmaAllocationCreateInfo alloc_info = {};
+        alloc_info.usage = config.memory_usage;
+        alloc_info.flags = config.allocation_flags;
+
+        VmaPoolCreateInfo pool_info = {};
+        if(vmaFindMemoryTypeIndexForBufferInfo(allocator, &buffer_info, &alloc_info, &pool_info.memoryTypeIndex) != VK_SUCCESS){
+            std::cout << "No memory type for the " << config.name << " pool, its buffers use the default allocation" << std::endl;
+            continue;
+        }
+        pool_info.flags = config.pool_flags;
+        pool_info.blockSize = config.block_size;
+
+        res = vmaCreatePool(allocator, &pool_info, &pools[i]);
+        if(res != VK_SUCCESS){
+            throw std::runtime_error(std::string("vmaCreatePool failed for the ") + config.name + " pool");
+        }
+        vmaSetPoolName(allocator, pools[i], config.name);
+        pool_fallbacks[i] = 0;
+
+        std::cout << "Memory pool " << config.name << ": memory type " << pool_info.memoryTypeIndex << ", "
+                  << toMiB(config.block_size) << " blocks" << ((config.pool_flags & VMA_POOL_CREATE_LINEAR_ALGORITHM_BIT) ? ", linear" : "") << std::endl;
+    }
+
 
     return allocator;
-}
\ No newline at end of file
+}
+
+void MemoryAllocator::destroyMemoryAllocator(VmaAllocator &allocator)
+{
+    for(VmaPool &pool : pools){
+        if(pool){
+            vmaDestroyPool(allocator, pool);
+            pool = nullptr;
+        }
+    }
+    vmaDestroyAllocator(allocator);
+    allocator = nullptr;
+}
+
+VmaPool MemoryAllocator::choosePool(MemoryClass memory_class, vk::DeviceSize size)
+{
+    size_t index = static_cast<size_t>(memory_class);
+    // Larger allocations would waste most of a new block, they get their own memory
+    if(!pools[index] || size > pool_configs[index].block_size / 2){
+        return nullptr;
+    }
+    return pools[index];
+}
+
+void MemoryAllocator::countPoolFallback(MemoryClass memory_class)
+{
+    pool_fallbacks[static_cast<size_t>(memory_class)]++;
+}
+
+void MemoryAllocator::printPoolStats(VmaAllocator allocator)
+{
+    for(size_t i = 1; i < pool_configs.size(); i++){
+        if(!pools[i]){
+            continue;
+        }
+        VmaDetailedStatistics stats;
+        vmaCalculatePoolStatistics(allocator, pools[i], &stats);
+        std::cout << "  Pool " << pool_configs[i].name << ": " << stats.statistics.blockCount << " blocks (" << toMiB(stats.statistics.blockBytes) << ")"
+                  << " | allocations: " << stats.statistics.allocationCount << " (" << toMiB(stats.statistics.allocationBytes) << ")"
+                  << " | free ranges: " << stats.unusedRangeCount
+                  << " | fallbacks: " << pool_fallbacks[i].load() << std::endl;
+    }
+}
+
+void MemoryAllocator::trackAllocation(VmaAllocator allocator, VmaAllocation allocation, const std::string &name)
+{
+    if(!allocator || !allocation){
+        return;
+    }
+
+    // Naming the allocation makes it recognizable in the VMA detailed stats as well
+    vmaSetAllocationName(allocator, allocation, name.c_str());
+
+    VmaAllocationInfo info;
+    vmaGetAllocationInfo(allocator, allocation, &info);
+    VkMemoryPropertyFlags flags;
+    vmaGetAllocationMemoryProperties(allocator, allocation, &flags);
+
+    TrackedAllocation tracked;
+    tracked.name = name;
+    tracked.size = info.size;
+    tracked.memory_type = info.memoryType;
+    const VkPhysicalDeviceMemoryProperties *memory_properties;
+    vmaGetMemoryProperties(allocator, &memory_properties);
+    tracked.heap = memory_properties -> memoryTypes[info.memoryType].heapIndex;
+    tracked.device_local = (flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0;
+    tracked.host_visible = (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+
+    std::lock_guard<std::mutex> lock(tracked_mutex);
+    tracked_allocations[allocation] = tracked;
+}
+
+void MemoryAllocator::untrackAllocation(VmaAllocation allocation)
+{
+    std::lock_guard<std::mutex> lock(tracked_mutex);
+    tracked_allocations.erase(allocation);
+}
+
+void MemoryAllocator::printMemoryReport(VmaAllocator allocator, const std::string &label, const std::vector<std::pair<std::string, size_t>> &cpu_allocations)
+{
+    const VkPhysicalDeviceMemoryProperties *memory_properties;
+    vmaGetMemoryProperties(allocator, &memory_properties);
+
+    VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+    vmaGetHeapBudgets(allocator, budgets);
+
+    std::cout << "\nMEMORY REPORT (" << label << ")" << std::endl;
+    for(uint32_t i = 0; i < memory_properties -> memoryHeapCount; i++){
+        const bool device_local = (memory_properties -> memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+        std::cout << "Heap " << i << (device_local ? " (device)" : " (host)")
+                  << " | usage: " << toMiB(budgets[i].usage) << " / budget: " << toMiB(budgets[i].budget)
+                  << " | blocks: " << toMiB(budgets[i].statistics.blockBytes)
+                  << " | allocations: " << budgets[i].statistics.allocationCount
+                  << " (" << toMiB(budgets[i].statistics.allocationBytes) << ")" << std::endl;
+    }
+
+    vk::DeviceSize total_device = 0;
+    vk::DeviceSize total_host = 0;
+    for(const auto &[key, group] : groupAllocations()){
+        std::cout << "  " << key.first << " x" << group.count << ": " << toMiB(group.size)
+                  << (group.device_local ? " [device" : " [host") << (group.host_visible ? ", mapped" : "")
+                  << ", heap " << group.heap << "]" << std::endl;
+        (group.device_local ? total_device : total_host) += group.size;
+    }
+    std::cout << "Tracked device memory: " << toMiB(total_device) << " | Tracked host memory: " << toMiB(total_host) << std::endl;
+    printPoolStats(allocator);
+
+    size_t total_cpu = 0;
+    for(const auto &[name, bytes] : cpu_allocations){
+        std::cout << "  CPU " << name << ": " << toMiB(bytes) << std::endl;
+        total_cpu += bytes;
+    }
+    if(!cpu_allocations.empty()){
+        std::cout << "CPU containers: " << toMiB(total_cpu) << std::endl;
+    }
+}
+
+void MemoryAllocator::dumpMemoryReport(VmaAllocator allocator, const std::string &label, const std::string &path, bool truncate,
+                                       const std::vector<std::pair<std::string, size_t>> &cpu_allocations)
+{
+    std::ofstream file(path, truncate ? std::ios::trunc : std::ios::app);
+    if(!file.is_open()){
+        std::cout << "Failed to open memory report file: " << path << std::endl;
+        return;
+    }
+
+    const VkPhysicalDeviceMemoryProperties *memory_properties;
+    vmaGetMemoryProperties(allocator, &memory_properties);
+
+    VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+    vmaGetHeapBudgets(allocator, budgets);
+
+    // One JSON object per line, so successive snapshots (startup, every menger step) can be diffed to spot leaks
+    file << "{\"label\":\"" << jsonEscape(label) << "\",\"heaps\":[";
+    for(uint32_t i = 0; i < memory_properties -> memoryHeapCount; i++){
+        const bool device_local = (memory_properties -> memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+        file << (i > 0 ? "," : "") << "{\"index\":" << i
+             << ",\"device_local\":" << (device_local ? "true" : "false")
+             << ",\"size\":" << memory_properties -> memoryHeaps[i].size
+             << ",\"budget\":" << budgets[i].budget
+             << ",\"usage\":" << budgets[i].usage
+             << ",\"block_bytes\":" << budgets[i].statistics.blockBytes
+             << ",\"allocation_bytes\":" << budgets[i].statistics.allocationBytes
+             << ",\"allocation_count\":" << budgets[i].statistics.allocationCount << "}";
+    }
+
+    file << "],\"allocations\":[";
+    bool first = true;
+    for(const auto &[key, group] : groupAllocations()){
+        file << (first ? "" : ",") << "{\"name\":\"" << jsonEscape(key.first) << "\""
+             << ",\"heap\":" << group.heap
+             << ",\"memory_type\":" << key.second
+             << ",\"count\":" << group.count
+             << ",\"size\":" << group.size
+             << ",\"device_local\":" << (group.device_local ? "true" : "false")
+             << ",\"host_visible\":" << (group.host_visible ? "true" : "false") << "}";
+        first = false;
+    }
+
+    file << "],\"cpu\":[";
+    first = true;
+    for(const auto &[name, bytes] : cpu_allocations){
+        file << (first ? "" : ",") << "{\"name\":\"" << jsonEscape(name) << "\",\"size\":" << bytes << "}";
+        first = false;
+    }
+
+    char *vma_stats = nullptr;
+    vmaBuildStatsString(allocator, &vma_stats, VK_TRUE);
+    std::string vma_json(vma_stats);
+    vmaFreeStatsString(allocator, vma_stats);
+    std::erase(vma_json, '\n'); // VMA pretty-prints, keep the snapshot on a single line
+
+    file << "],\"vma\":" << vma_json << "}" << std::endl;
+}
+
+FrameArena MemoryAllocator::createFrameArena(vk::DeviceSize capacity, const vk::raii::PhysicalDevice &physical_device, const std::string &name, VmaAllocator &vma_allocator)
+{
+    vk::PhysicalDeviceLimits limits = physical_device.getProperties().limits;
+
+    FrameArena arena;
+    arena.capacity = capacity;
+    // 64 bytes keeps every allocation addressable in mat4 units from the shaders
+    arena.alignment = std::max({vk::DeviceSize(64), limits.minUniformBufferOffsetAlignment, limits.minStorageBufferOffsetAlignment});
+    arena.memory.buffer = Device::createBuffer(
+        capacity,
+        vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eShaderDeviceAddress |
+        vk::BufferUsageFlagBits::eIndirectBuffer,
+        vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+        name,
+        vma_allocator,
+        MemoryClass::Uniform
+    );
+    arena.memory.data = arena.memory.buffer.info.pMappedData;
+
+    return arena;
+}
+
+ArenaAllocation MemoryAllocator::arenaAllocate(FrameArena &arena, vk::DeviceSize size)
+{
+    vk::DeviceSize offset = (arena.head + arena.alignment - 1) / arena.alignment * arena.alignment;
+    if(offset + size > arena.capacity){
+        throw std::runtime_error("Frame arena " + arena.memory.buffer.name + " out of space: " + std::to_string(offset + size) + " of " + std::to_string(arena.capacity) + " bytes");
+    }
+    arena.head = offset + size;
+    arena.peak = std::max(arena.peak, arena.head);
+
+    ArenaAllocation allocation;
+    allocation.offset = offset;
+    allocation.data = static_cast<char*>(arena.memory.data) + offset;
+    return allocation;
+}
+
+void MemoryAllocator::resetArena(FrameArena &arena)
+{
+    arena.head = 0;
+}
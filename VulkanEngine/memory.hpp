@@ -3,6 +3,37 @@
 #include "../Helpers/GeneralLibraries.hpp"
 
 namespace MemoryAllocator{
-    // Creates the memory allocator
+    // Creates the memory allocator and one custom pool per MemoryClass: frequent creation and destruction of buffers
+    // (level changes, staging) reuses the blocks of their pool instead of going to the driver every time
     VmaAllocator createMemoryAllocator(const vk::raii::PhysicalDevice &physical_device, const vk::raii::Device &logical_device, const vk::raii::Instance &instance);
-}
\ No newline at end of file
+    // Destroys the pools and the allocator. Every buffer and image must have been destroyed
+    void destroyMemoryAllocator(VmaAllocator &allocator);
+
+    // Pool for an allocation of size bytes of a class, nullptr when it should get its own memory (default class,
+    // allocations too large for the pool blocks)
+    VmaPool choosePool(MemoryClass memory_class, vk::DeviceSize size);
+    // Counts the allocations a pool could not serve, they fall back to memory chosen by VMA
+    void countPoolFallback(MemoryClass memory_class);
+    // Prints blocks, allocations and free ranges of every pool, free ranges growing over time mean fragmentation
+    void printPoolStats(VmaAllocator allocator);
+
+    // Registers a named allocation so that it shows up in the memory report
+    void trackAllocation(VmaAllocator allocator, VmaAllocation allocation, const std::string &name);
+    // Removes an allocation from the memory report. Called when the owning buffer/image is destroyed
+    void untrackAllocation(VmaAllocation allocation);
+
+    // Prints heap budgets and the tracked allocations grouped by name, split between host and device memory.
+    // cpu_allocations lists plain CPU-side containers (name, bytes) worth reporting next to the Vulkan memory
+    void printMemoryReport(VmaAllocator allocator, const std::string &label, const std::vector<std::pair<std::string, size_t>> &cpu_allocations = {});
+    // Writes the same report as a single JSON line (plus the VMA detailed stats) to path. truncate starts a new file
+    void dumpMemoryReport(VmaAllocator allocator, const std::string &label, const std::string &path, bool truncate,
+                          const std::vector<std::pair<std::string, size_t>> &cpu_allocations = {});
+
+    // Creates the arena of a frame in flight: a single persistently mapped buffer of capacity bytes, usable as uniform,
+    // storage, indirect commands or through its device address. Allocations are aligned for any of those uses
+    FrameArena createFrameArena(vk::DeviceSize capacity, const vk::raii::PhysicalDevice &physical_device, const std::string &name, VmaAllocator &vma_allocator);
+    // Bump allocates size bytes from the arena. Throws when the frame needs more than the capacity
+    ArenaAllocation arenaAllocate(FrameArena &arena, vk::DeviceSize size);
+    // Starts a new frame of allocations. The GPU must be done with the previous frame that used the arena
+    void resetArena(FrameArena &arena);
+}
@@ -0,0 +1,195 @@
+#include "meshes.hpp"
+#include "device.hpp"
+
+#include <algorithm>
+
+void MeshPool::create(uint32_t max_vertices, uint32_t max_indices, VmaAllocator &vma_allocator)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const std::array<VertexFormat, 2> formats = {VertexFormat::Full, VertexFormat::Compact};
+    for(VertexFormat format : formats){
+        size_t index = static_cast<size_t>(format);
+        vertex_buffers[index] = Device::createBuffer(
+            VertexInputDescription::stride(format) * vk::DeviceSize(max_vertices),
+            vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eVertexBuffer,
+            vk::MemoryPropertyFlagBits::eDeviceLocal,
+            format == VertexFormat::Compact ? "Mesh pool compact vertices" : "Mesh pool vertices",
+            vma_allocator,
+            MemoryClass::Geometry
+        );
+        vertex_ranges[index] = Ranges();
+        vertex_ranges[index].capacity = max_vertices;
+        vertex_ranges[index].free_ranges.push_back({0, max_vertices});
+    }
+    index_buffer = Device::createBuffer(
+        sizeof(uint32_t) * vk::DeviceSize(max_indices),
+        vk::BufferUsageFlagBits::eTransferDst | vk::BufferUsageFlagBits::eIndexBuffer,
+        vk::MemoryPropertyFlagBits::eDeviceLocal,
+        "Mesh pool indices",
+        vma_allocator,
+        MemoryClass::Geometry
+    );
+
+    index_ranges = Ranges();
+    index_ranges.capacity = max_indices;
+    index_ranges.free_ranges.push_back({0, max_indices});
+
+    std::cout << "Mesh pool: " << max_vertices << " vertices per format, " << max_indices << " indices" << std::endl;
+}
+
+void MeshPool::destroy()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    vertex_buffers = {};
+    index_buffer = AllocatedBuffer();
+    vertex_ranges = {};
+    index_ranges = Ranges();
+    retirer = nullptr;
+}
+
+uint32_t MeshPool::allocateRange(Ranges &ranges, uint32_t count, const std::string &name)
+{
+    for(auto it = ranges.free_ranges.begin(); it != ranges.free_ranges.end(); ++it){
+        if(it -> count >= count){
+            uint32_t offset = it -> offset;
+            it -> offset += count;
+            it -> count -= count;
+            if(it -> count == 0){
+                ranges.free_ranges.erase(it);
+            }
+            ranges.used += count;
+            return offset;
+        }
+    }
+    throw std::runtime_error("Mesh pool out of " + name + ": " + std::to_string(count) + " requested, "
+                             + std::to_string(ranges.capacity - ranges.used) + " free in " + std::to_string(ranges.free_ranges.size()) + " ranges");
+}
+
+void MeshPool::freeRange(Ranges &ranges, uint32_t offset, uint32_t count)
+{
+    auto next = std::lower_bound(ranges.free_ranges.begin(), ranges.free_ranges.end(), offset,
+                                 [](const Range &range, uint32_t value){ return range.offset < value; });
+    auto it = ranges.free_ranges.insert(next, {offset, count});
+    ranges.used -= count;
+
+    // Merging with the following range, then with the previous one
+    auto following = std::next(it);
+    if(following != ranges.free_ranges.end() && it -> offset + it -> count == following -> offset){
+        it -> count += following -> count;
+        ranges.free_ranges.erase(following);
+    }
+    if(it != ranges.free_ranges.begin()){
+        auto previous = std::prev(it);
+        if(previous -> offset + previous -> count == it -> offset){
+            previous -> count += it -> count;
+            ranges.free_ranges.erase(it);
+        }
+    }
+}
+
+MeshAllocation MeshPool::upload(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices, VertexFormat format,
+                                VmaAllocator &vma_allocator, vk::raii::Device &logical_device, QueuePool &queue_pool)
+{
+    MeshAllocation mesh;
+    mesh.format = format;
+    if(vertices.empty() || indices.empty()){
+        return mesh;
+    }
+
+    size_t format_index = static_cast<size_t>(format);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        mesh.first_vertex = allocateRange(vertex_ranges[format_index], static_cast<uint32_t>(vertices.size()), "vertices");
+        try{
+            mesh.first_index = allocateRange(index_ranges, static_cast<uint32_t>(indices.size()), "indices");
+        }
+        catch(...){
+            freeRange(vertex_ranges[format_index], mesh.first_vertex, static_cast<uint32_t>(vertices.size()));
+            throw;
+        }
+    }
+    mesh.vertex_count = static_cast<uint32_t>(vertices.size());
+    mesh.index_count = static_cast<uint32_t>(indices.size());
+
+    // Compact meshes are packed once here, the vertex buffer only ever holds the packed vertices
+    std::vector<CompactVertex> compact_vertices;
+    const void *vertex_data = vertices.data();
+    if(format == VertexFormat::Compact){
+        compact_vertices.reserve(vertices.size());
+        for(const Vertex &vertex : vertices){
+            compact_vertices.push_back(CompactVertex::pack(vertex));
+        }
+        vertex_data = compact_vertices.data();
+    }
+
+    vk::DeviceSize stride = VertexInputDescription::stride(format);
+    vk::DeviceSize vertex_size = stride * vertices.size();
+    vk::DeviceSize index_size = sizeof(uint32_t) * indices.size();
+
+    AllocatedBuffer staging_buffer = Device::createBuffer(vertex_size + index_size, vk::BufferUsageFlagBits::eTransferSrc,
+        vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, "mesh staging buffer", vma_allocator, MemoryClass::Staging);
+
+    void * data = staging_buffer.info.pMappedData; // Created persistently mapped
+    memcpy(data, vertex_data, (size_t)vertex_size);
+    memcpy((char *)data + vertex_size, indices.data(), (size_t)index_size);
+
+    // Both copies in a single submission, on the graphics queue: the pool buffers are exclusive to the graphics family
+    // drawing from them, a copy on a dedicated transfer family would need an ownership transfer
+    vk::raii::CommandBuffer command_buffer = Device::beginSingleTimeCommands(queue_pool.graphics_command_pool, logical_device);
+    command_buffer.copyBuffer(staging_buffer.buffer, vertex_buffers[format_index].buffer, vk::BufferCopy(0, stride * mesh.first_vertex, vertex_size));
+    command_buffer.copyBuffer(staging_buffer.buffer, index_buffer.buffer, vk::BufferCopy(vertex_size, sizeof(uint32_t) * vk::DeviceSize(mesh.first_index), index_size));
+    Device::endSingleTimeCommands(command_buffer, queue_pool.graphics_queue);
+
+    return mesh;
+}
+
+void MeshPool::release(const MeshAllocation &mesh)
+{
+    if(mesh.index_count == 0){
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    freeRange(vertex_ranges[static_cast<size_t>(mesh.format)], mesh.first_vertex, mesh.vertex_count);
+    freeRange(index_ranges, mesh.first_index, mesh.index_count);
+}
+
+void MeshPool::retire(const MeshAllocation &mesh)
+{
+    if(mesh.index_count == 0){
+        return;
+    }
+    if(!retirer){
+        release(mesh);
+        return;
+    }
+    retirer([this, mesh](){ release(mesh); });
+}
+
+void MeshPool::setRetirer(std::function<void(std::function<void()>&&)> &&retirer)
+{
+    this -> retirer = std::move(retirer);
+}
+
+void MeshPool::bind(vk::raii::CommandBuffer &command_buffer, VertexFormat format) const
+{
+    command_buffer.bindVertexBuffers(0, vertex_buffers[static_cast<size_t>(format)].buffer, {0});
+    command_buffer.bindIndexBuffer(index_buffer.buffer, 0, vk::IndexType::eUint32);
+}
+
+vk::DrawIndexedIndirectCommand MeshPool::drawCommand(const MeshAllocation &mesh, uint32_t instance_count, uint32_t first_instance)
+{
+    // vertexOffset is added to every index, meshes keep indices relative to their own first vertex
+    return vk::DrawIndexedIndirectCommand(mesh.index_count, instance_count, mesh.first_index, static_cast<int32_t>(mesh.first_vertex), first_instance);
+}
+
+void MeshPool::printStats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const Ranges &full = vertex_ranges[static_cast<size_t>(VertexFormat::Full)];
+    const Ranges &compact = vertex_ranges[static_cast<size_t>(VertexFormat::Compact)];
+    std::cout << "Mesh pool usage: vertices " << full.used << "/" << full.capacity
+              << " compact vertices " << compact.used << "/" << compact.capacity
+              << " indices " << index_ranges.used << "/" << index_ranges.capacity
+              << " (" << full.free_ranges.size() + compact.free_ranges.size() + index_ranges.free_ranges.size() << " free ranges)" << std::endl;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "../Helpers/GeneralLibraries.hpp"
+
+#include <mutex>
+
+// Single vertex buffer per vertex format and index buffer shared by every mesh. Meshes are sub-allocated in them, so all
+// the objects of a format are drawn after one bindVertexBuffers/bindIndexBuffer, possibly with a single multi-draw-indirect
+// over many meshes. Thread safe, except for upload
+class MeshPool{
+public:
+    MeshPool() = default;
+
+    // Disable copying and moving, the objects keep their offsets in the pool buffers
+    MeshPool(const MeshPool&) = delete;
+    MeshPool& operator=(const MeshPool&) = delete;
+
+    // Creates the device local buffers, sized for max_vertices vertices of each format and max_indices indices
+    void create(uint32_t max_vertices, uint32_t max_indices, VmaAllocator &vma_allocator);
+
+    // Releases both buffers. Must be called before destroying the allocator
+    void destroy();
+
+    // Copies a mesh in free ranges of the buffers through a staging buffer, waiting for the copy on the graphics queue, so
+    // only from the thread recording the frames. The vertices are packed in the given format first. Throws when the pool
+    // is full. An empty mesh gets an empty allocation, with nothing to draw
+    MeshAllocation upload(const std::vector<Vertex> &vertices, const std::vector<uint32_t> &indices, VertexFormat format,
+                          VmaAllocator &vma_allocator, vk::raii::Device &logical_device, QueuePool &queue_pool);
+
+    // Returns the ranges of a mesh to the pool. The frames drawing it must have completed
+    void release(const MeshAllocation &mesh);
+
+    // Releases a mesh that frames in flight may still draw: the release is handed to the function set with setRetirer,
+    // e.g. pushed in a deletion queue, or done immediately without one
+    void retire(const MeshAllocation &mesh);
+    void setRetirer(std::function<void(std::function<void()>&&)> &&retirer);
+
+    // Binds the vertex buffer of a format as binding 0 and the index buffer
+    void bind(vk::raii::CommandBuffer &command_buffer, VertexFormat format = VertexFormat::Full) const;
+
+    // Indirect command drawing instance_count instances of a mesh, starting from first_instance (gl_InstanceIndex)
+    static vk::DrawIndexedIndirectCommand drawCommand(const MeshAllocation &mesh, uint32_t instance_count, uint32_t first_instance);
+
+    // Prints used and available vertices and indices
+    void printStats();
+
+private:
+    // Free part of a buffer, in elements
+    struct Range{
+        uint32_t offset;
+        uint32_t count;
+    };
+
+    // Elements of one buffer: free ranges sorted by offset
+    struct Ranges{
+        uint32_t capacity = 0;
+        uint32_t used = 0;
+        std::vector<Range> free_ranges;
+    };
+
+    std::mutex mutex; // Protects the ranges
+    std::array<AllocatedBuffer, 2> vertex_buffers; // [VertexFormat]
+    AllocatedBuffer index_buffer;
+    std::array<Ranges, 2> vertex_ranges; // [VertexFormat]
+    Ranges index_ranges;
+    std::function<void(std::function<void()>&&)> retirer;
+
+    // First fit in the free ranges, throws when no range is large enough. The mutex must be held
+    static uint32_t allocateRange(Ranges &ranges, uint32_t count, const std::string &name);
+    // Inserts a range back, merging it with its neighbours. The mutex must be held
+    static void freeRange(Ranges &ranges, uint32_t offset, uint32_t count);
+};
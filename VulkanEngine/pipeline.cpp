@@ -1,15 +1,47 @@
 #include "pipeline.hpp"
+#include "shaders.hpp"
 
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <cstring>
+
+// Header written in front of the cache data. The driver validates its own data too, but a cache from another driver
+// version is better discarded up front than handed to it
+struct PipelineCacheFileHeader{
+    uint32_t magic = 0x4350454d; // "MEPC"
+    uint32_t vendor_id = 0;
+    uint32_t device_id = 0;
+    uint32_t driver_version = 0;
+    uint8_t cache_uuid[VK_UUID_SIZE] = {};
+    uint64_t data_size = 0;
+};
+
+// Header expected for the current device
+static PipelineCacheFileHeader makeCacheHeader(const vk::raii::PhysicalDevice &physical_device)
+{
+    vk::PhysicalDeviceProperties properties = physical_device.getProperties();
+
+    PipelineCacheFileHeader header;
+    header.vendor_id = properties.vendorID;
+    header.device_id = properties.deviceID;
+    header.driver_version = properties.driverVersion;
+    std::memcpy(header.cache_uuid, properties.pipelineCacheUUID.data(), VK_UUID_SIZE);
+
+    return header;
+}
+
 RasterPipelineBundle Pipeline::createsRasterPipeline(const std::string &v_shader_path, const std::string &f_shader_path, 
                                 std::vector<vk::DescriptorSetLayoutBinding> *bindings, vk::CullModeFlags cull_mode, 
                                 vk::Format color_format, vk::Format depth_format, vk::SampleCountFlagBits &msaa_samples,
                                  std::string &name, vk::raii::DescriptorSetLayout *descriptor_set_layout,
-                                vk::raii::Device &logical_device)
+                                vk::raii::Device &logical_device, vk::raii::PipelineCache *pipeline_cache,
+                                const SpecializationConstants &specialization,
+                                vk::DescriptorSetLayout shared_set_layout,
+                                const std::vector<vk::PushConstantRange> &push_constant_ranges,
+                                VertexFormat vertex_format)
 {
     RasterPipelineBundle pipeline_bundle;
     pipeline_bundle.pipeline_name = name;
@@ -22,48 +54,89 @@ RasterPipelineBundle Pipeline::createsRasterPipeline(const std::string &v_shader
     pipeline_bundle.topology = vk::PrimitiveTopology::eTriangleList;
     pipeline_bundle.polygon_mode = vk::PolygonMode::eFill;
     pipeline_bundle.front_face = vk::FrontFace::eCounterClockwise;
+    pipeline_bundle.specialization = specialization;
+    pipeline_bundle.shared_set_layout = shared_set_layout;
+    pipeline_bundle.push_constant_ranges = push_constant_ranges;
+    pipeline_bundle.vertex_format = vertex_format;
 
     std::cout << "Creating Raster pipeline. Name: " << pipeline_bundle.pipeline_name << std::endl;
 
     // Defining the shader associated with the pipeline
-    pipeline_bundle.v_shader = createShaderModule(readFile(v_shader_path), logical_device);
-    pipeline_bundle.f_shader = createShaderModule(readFile(f_shader_path), logical_device);
+    pipeline_bundle.v_shader = ShaderCache::loadModule(v_shader_path, logical_device);
+    pipeline_bundle.f_shader = ShaderCache::loadModule(f_shader_path, logical_device);
+
+    // Creating the descriptor set layout. Pipelines on the descriptor heap have no bindings on purpose: resources come
+    // from the shared layout, nothing to create and nothing to warn about
+    if(!shared_set_layout){
+        if(descriptor_set_layout != nullptr){
+            pipeline_bundle.descriptor_set_layout = std::move(*descriptor_set_layout);
+        }
+        else{
+            std::vector<vk::DescriptorSetLayoutBinding> no_bindings;
+            if(bindings == nullptr || bindings -> empty()){
+                std::cout << "Empty bindings! This might be an error!" << std::endl;
+            }
+            pipeline_bundle.descriptor_set_layout = createDescriptorSetLayout(bindings != nullptr ? *bindings : no_bindings, logical_device);
+        }
+    }
+
+    // Layout create info
+    vk::DescriptorSetLayout set_layout = shared_set_layout ? shared_set_layout : *pipeline_bundle.descriptor_set_layout;
+    vk::PipelineLayoutCreateInfo pipeline_layout_info;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &set_layout;
+    pipeline_layout_info.pushConstantRangeCount = static_cast<uint32_t>(pipeline_bundle.push_constant_ranges.size());
+    pipeline_layout_info.pPushConstantRanges = pipeline_bundle.push_constant_ranges.data();
+    pipeline_bundle.layout = vk::raii::PipelineLayout(logical_device, pipeline_layout_info);
+
+    auto build_start = std::chrono::high_resolution_clock::now();
+    pipeline_bundle.pipeline = createPipelineObject(pipeline_bundle, *pipeline_bundle.v_shader, *pipeline_bundle.f_shader, logical_device, pipeline_cache);
+    pipeline_bundle.build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - build_start).count();
+
+    std::cout << "Created Pipeline:\n" << pipeline_bundle.to_str() << std::endl;
+
 
+    return pipeline_bundle;
+
+}
+
+vk::raii::Pipeline Pipeline::createPipelineObject(const RasterPipelineBundle &bundle, const vk::raii::ShaderModule &v_shader, const vk::raii::ShaderModule &f_shader,
+                                              vk::raii::Device &logical_device, vk::raii::PipelineCache *pipeline_cache)
+{
+    // Defining the shader associated with the pipeline
     vk::PipelineShaderStageCreateInfo vert_shader_stage_info;
     vert_shader_stage_info.stage = vk::ShaderStageFlagBits::eVertex;
-    vert_shader_stage_info.module = *pipeline_bundle.v_shader;
+    vert_shader_stage_info.module = *v_shader;
     vert_shader_stage_info.pName = "main";
 
     vk::PipelineShaderStageCreateInfo frag_shader_stage_info;
     frag_shader_stage_info.stage = vk::ShaderStageFlagBits::eFragment;
-    frag_shader_stage_info.module = *pipeline_bundle.f_shader;
+    frag_shader_stage_info.module = *f_shader;
     frag_shader_stage_info.pName = "main";
 
+    // Both stages read the same constants, each one only uses the ids it declares
+    vk::SpecializationInfo specialization_info;
+    if(!bundle.specialization.empty()){
+        specialization_info.mapEntryCount = static_cast<uint32_t>(bundle.specialization.entries.size());
+        specialization_info.pMapEntries = bundle.specialization.entries.data();
+        specialization_info.dataSize = bundle.specialization.data.size();
+        specialization_info.pData = bundle.specialization.data.data();
+        vert_shader_stage_info.pSpecializationInfo = &specialization_info;
+        frag_shader_stage_info.pSpecializationInfo = &specialization_info;
+    }
+
     vk::PipelineShaderStageCreateInfo shader_stages[] = {
         vert_shader_stage_info, frag_shader_stage_info
     };
 
-    // Creating the descriptor set layout
-    if(descriptor_set_layout != nullptr){
-        pipeline_bundle.descriptor_set_layout = std::move(*descriptor_set_layout);
-    }
-    else if(bindings != nullptr && (*bindings).size() > 0){
-        pipeline_bundle.descriptor_set_layout = createDescriptorSetLayout(*bindings, logical_device);
-    }
-    else{
-        std::cout << "Empty bindings! This might be an error!" << std::endl;
-        pipeline_bundle.descriptor_set_layout = createDescriptorSetLayout(*bindings, logical_device);
-    }
-
-    // Vertex components
-    vk::VertexInputBindingDescription binding_description = Vertex::getBindingDescription();
-    auto attribute_descriptions = Vertex::getAttributeDescriptions(); // Here auto since probably the array will change in future, it is just safer
+    // Vertex components, described by the vertex format of the pipeline
+    VertexInputDescription vertex_input = VertexInputDescription::of(bundle.vertex_format);
 
     vk::PipelineVertexInputStateCreateInfo vertex_input_info;
     vertex_input_info.vertexBindingDescriptionCount = 1;
-    vertex_input_info.pVertexBindingDescriptions = &binding_description; 
-    vertex_input_info.vertexAttributeDescriptionCount = static_cast<uint32_t>(attribute_descriptions.size()); // Good practice to cast
-    vertex_input_info.pVertexAttributeDescriptions = attribute_descriptions.data(); 
+    vertex_input_info.pVertexBindingDescriptions = &vertex_input.binding; 
+    vertex_input_info.vertexAttributeDescriptionCount = static_cast<uint32_t>(vertex_input.attributes.size()); // Good practice to cast
+    vertex_input_info.pVertexAttributeDescriptions = vertex_input.attributes.data(); 
 
 
     // Topology of the pipeline (how to group the vertices)
@@ -79,15 +152,15 @@ RasterPipelineBundle Pipeline::createsRasterPipeline(const std::string &v_shader
     vk::PipelineRasterizationStateCreateInfo rasterizer;
     rasterizer.depthClampEnable = vk::False; // If true, pixels outside the viewing frustum will be smashed on the far/near plane
     rasterizer.rasterizerDiscardEnable = vk::False; // When ture, pipeline stops after vertex shader. USed for calculation with no rendering
-    rasterizer.cullMode = pipeline_bundle.cull_mode;
-    rasterizer.polygonMode = pipeline_bundle.polygon_mode;
-    rasterizer.frontFace = pipeline_bundle.front_face;
+    rasterizer.cullMode = bundle.cull_mode;
+    rasterizer.polygonMode = bundle.polygon_mode;
+    rasterizer.frontFace = bundle.front_face;
     rasterizer.depthBiasEnable = vk::False; // Used to slightly offset depth value of pixels. Primarly used to fix "shadow acne"
     rasterizer.lineWidth = 1.f; // Only relevant if drawing lines or using eLine mode. Required wideLines GPU feature
 
     // Multisampling info
     vk::PipelineMultisampleStateCreateInfo multisampling;
-    multisampling.rasterizationSamples = pipeline_bundle.msaa_samples;
+    multisampling.rasterizationSamples = bundle.msaa_samples;
     multisampling.sampleShadingEnable = vk::False;
 
     // Depth and stencil setup
@@ -120,16 +193,10 @@ RasterPipelineBundle Pipeline::createsRasterPipeline(const std::string &v_shader
     dynamic_state.pDynamicStates = dynamic_states.data();
 
 
-    // Layout create info
-    vk::PipelineLayoutCreateInfo pipeline_layout_info;
-    pipeline_layout_info.setLayoutCount = 1;
-    pipeline_layout_info.pSetLayouts = &*(pipeline_bundle.descriptor_set_layout);    
-    pipeline_bundle.layout = vk::raii::PipelineLayout(logical_device, pipeline_layout_info);
-
     vk::PipelineRenderingCreateInfo pipeline_rendering_create_info;
     pipeline_rendering_create_info.colorAttachmentCount = 1;
-    pipeline_rendering_create_info.pColorAttachmentFormats = &pipeline_bundle.color_format;
-    pipeline_rendering_create_info.depthAttachmentFormat = pipeline_bundle.depth_format;
+    pipeline_rendering_create_info.pColorAttachmentFormats = &bundle.color_format;
+    pipeline_rendering_create_info.depthAttachmentFormat = bundle.depth_format;
 
 
     vk::GraphicsPipelineCreateInfo pipeline_info;
@@ -142,149 +209,86 @@ RasterPipelineBundle Pipeline::createsRasterPipeline(const std::string &v_shader
     pipeline_info.pRasterizationState = &rasterizer;
     pipeline_info.pColorBlendState = &color_blending;
     pipeline_info.pDynamicState = &dynamic_state;
-    pipeline_info.layout = pipeline_bundle.layout;
+    pipeline_info.layout = bundle.layout;
     pipeline_info.pDepthStencilState = &depth_stencil;
     pipeline_info.pMultisampleState = &multisampling;
 
-    pipeline_bundle.pipeline = vk::raii::Pipeline(logical_device, nullptr, pipeline_info);
-
-    std::cout << "Created Pipeline:\n" << pipeline_bundle.to_str() << std::endl;
-
-
-    return pipeline_bundle;
-
+    return vk::raii::Pipeline(logical_device, pipeline_cache, pipeline_info);
 }
 
-vk::raii::DescriptorSetLayout Pipeline::createDescriptorSetLayout(std::vector<vk::DescriptorSetLayoutBinding> &bindings, const vk::raii::Device &logical_device)
+RasterPipelineBundle Pipeline::createsRasterPipeline(RasterPipelineRequest &request, vk::raii::Device &logical_device, vk::raii::PipelineCache *pipeline_cache)
 {
-    vk::DescriptorSetLayoutCreateInfo layout_info({}, bindings.size(), bindings.data());
-
-    return std::move(vk::raii::DescriptorSetLayout(logical_device, layout_info));
+    return createsRasterPipeline(request.v_shader_path, request.f_shader_path, &request.bindings, request.cull_mode,
+                                 request.color_format, request.depth_format, request.msaa_samples,
+                                 request.name, nullptr, logical_device, pipeline_cache, request.specialization,
+                                 request.shared_set_layout, request.push_constant_ranges, request.vertex_format);
 }
 
-vk::raii::DescriptorPool Pipeline::createDescriptorPool(std::vector<vk::DescriptorSetLayoutBinding> &bindings, vk::raii::Device &logical_device, int max_frames_in_flight)
+vk::raii::PipelineCache Pipeline::createPipelineCache(const vk::raii::PhysicalDevice &physical_device, const vk::raii::Device &logical_device,
+                                                     const std::string &path, bool load, size_t &loaded_size)
 {
-    std::vector<vk::DescriptorPoolSize> pool_sizes;
-
-    int total_uniform_buffers = 0;
-    int total_ssbo = 0;
-    for(size_t i = 0; i < bindings.size(); i++){
-        if(bindings[i].descriptorType == vk::DescriptorType::eUniformBuffer){
-            total_uniform_buffers += bindings[i].descriptorCount;
+    loaded_size = 0;
+    std::vector<char> data;
+
+    std::ifstream file(path, std::ios::ate | std::ios::binary);
+    if(load && file.is_open()){
+        size_t file_size = (size_t) file.tellg();
+        PipelineCacheFileHeader expected = makeCacheHeader(physical_device);
+        PipelineCacheFileHeader header;
+
+        file.seekg(0);
+        if(file_size < sizeof(header) || !file.read(reinterpret_cast<char*>(&header), sizeof(header))){
+            std::cout << "Pipeline cache " << path << " is truncated, starting cold" << std::endl;
         }
-        else if(bindings[i].descriptorType == vk::DescriptorType::eStorageBuffer){
-            total_ssbo += bindings[i].descriptorCount;
+        else if(header.magic != expected.magic || header.vendor_id != expected.vendor_id || header.device_id != expected.device_id ||
+                header.driver_version != expected.driver_version || std::memcmp(header.cache_uuid, expected.cache_uuid, VK_UUID_SIZE) != 0){
+            std::cout << "Pipeline cache " << path << " was created by another device or driver, starting cold" << std::endl;
+        }
+        else if(header.data_size != file_size - sizeof(header)){
+            std::cout << "Pipeline cache " << path << " has an unexpected size, starting cold" << std::endl;
+        }
+        else{
+            data.resize(header.data_size);
+            file.read(data.data(), data.size());
+            loaded_size = data.size();
         }
     }
 
-    if(total_uniform_buffers > 0){
-        pool_sizes.push_back(vk::DescriptorPoolSize(vk::DescriptorType::eUniformBuffer, total_uniform_buffers));
-    }
-    if(total_ssbo > 0){
-        pool_sizes.push_back(vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer, total_ssbo));
-    }
-
-    vk::DescriptorPoolCreateInfo pool_info;
-    pool_info.flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet;
-    pool_info.maxSets = max_frames_in_flight;
-    pool_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size()); 
-    pool_info.pPoolSizes = pool_sizes.data();
+    vk::PipelineCacheCreateInfo cache_info;
+    cache_info.initialDataSize = data.size();
+    cache_info.pInitialData = data.data();
 
-    return std::move(vk::raii::DescriptorPool(logical_device, pool_info));
+    return vk::raii::PipelineCache(logical_device, cache_info);
 }
 
-std::vector<vk::raii::DescriptorSet> Pipeline::createDescriptorSets(vk::raii::DescriptorSetLayout &descriptor_set_layout, vk::raii::DescriptorPool &descriptor_pool, vk::raii::Device &logical_device, int max_frames_in_flight)
+void Pipeline::savePipelineCache(const vk::raii::PipelineCache &pipeline_cache, const vk::raii::PhysicalDevice &physical_device, const std::string &path)
 {
-    std::vector<vk::raii::DescriptorSet> descriptor_sets;
+    std::vector<uint8_t> data = pipeline_cache.getData();
 
-    vk::DescriptorSetAllocateInfo alloc_info(*descriptor_pool, 1, &*descriptor_set_layout);
+    PipelineCacheFileHeader header = makeCacheHeader(physical_device);
+    header.data_size = data.size();
 
-    for(size_t i = 0; i < max_frames_in_flight; i++){
-        descriptor_sets.push_back(std::move(logical_device.allocateDescriptorSets(alloc_info).front()));
+    // Written next to the destination and renamed, so an interrupted write never leaves a corrupted cache behind
+    const std::string temp_path = path + ".tmp";
+    std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+    if(!file.is_open()){
+        std::cout << "Failed to write pipeline cache " << temp_path << std::endl;
+        return;
     }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(data.data()), data.size());
+    file.close();
 
-    return std::move(descriptor_sets);
-}
-
-// TODO: Chenge from void * to a more safe option
-void Pipeline::writeDescriptorSets(
-    const std::vector<vk::raii::DescriptorSet> &descriptor_sets, 
-    const std::vector<vk::DescriptorSetLayoutBinding> &bindings, 
-    const std::vector<void *> &resources, 
-    vk::raii::Device &logical_device, 
-    const int max_frames_in_flight) 
-{
-    for (size_t i = 0; i < max_frames_in_flight; i++) {
-        std::vector<vk::WriteDescriptorSet> writes;
-        
-        std::deque<std::vector<vk::DescriptorBufferInfo>> multi_buffer_infos;
-        std::deque<vk::DescriptorBufferInfo> single_buffer_infos;
-
-        for (size_t j = 0; j < bindings.size(); j++) {
-            if (bindings[j].descriptorType == vk::DescriptorType::eUniformBuffer || bindings[j].descriptorType == vk::DescriptorType::eStorageBuffer) {
-                
-                if (bindings[j].descriptorCount > 1) {
-                    auto &info_vec = multi_buffer_infos.emplace_back();
-                    info_vec.reserve(bindings[j].descriptorCount);
-
-                    auto* res_ptr = static_cast<std::vector<std::vector<MappedUBO>>*>(resources[j]);
-                    
-                    for (size_t k = 0; k < bindings[j].descriptorCount; k++) {
-                        AllocatedBuffer &buffer = (*res_ptr)[k][i].buffer;
-                        info_vec.push_back(vk::DescriptorBufferInfo{buffer.buffer, 0, buffer.size});
-                    }
-
-                    writes.push_back(vk::WriteDescriptorSet{
-                        *descriptor_sets[i], bindings[j].binding, 0,
-                        bindings[j].descriptorCount, bindings[j].descriptorType,
-                        nullptr, info_vec.data(), nullptr
-                    });
-                } 
-                else {
-                    auto* res_ptr = static_cast<std::vector<MappedUBO>*>(resources[j]);
-                    AllocatedBuffer &buffer = (*res_ptr)[i].buffer;
-                    
-                    vk::DescriptorBufferInfo &info = single_buffer_infos.emplace_back(
-                        buffer.buffer, 0, buffer.size
-                    );
-
-                    writes.push_back(vk::WriteDescriptorSet{
-                        *descriptor_sets[i], bindings[j].binding, 0,
-                        1, bindings[j].descriptorType,
-                        nullptr, &info, nullptr
-                    });
-                }
-            }
-        }
-
-        if (!writes.empty()) {
-            logical_device.updateDescriptorSets(writes, nullptr);
-        }
-
-        multi_buffer_infos.clear();
-        single_buffer_infos.clear();
+    if(std::rename(temp_path.c_str(), path.c_str()) != 0){
+        std::cout << "Failed to replace pipeline cache " << path << std::endl;
+        return;
     }
+    std::cout << "Saved pipeline cache (" << data.size() / 1024.0 << " KB) to " << path << std::endl;
 }
 
-vk::raii::ShaderModule Pipeline::createShaderModule(const std::vector<char> &code, const vk::raii::Device &logical_device)
+vk::raii::DescriptorSetLayout Pipeline::createDescriptorSetLayout(std::vector<vk::DescriptorSetLayoutBinding> &bindings, const vk::raii::Device &logical_device)
 {
-    vk::ShaderModuleCreateInfo create_info;
-    create_info.codeSize = code.size();
-    create_info.pCode = reinterpret_cast<const uint32_t*>(code.data());
-
-    vk::raii::ShaderModule shader_module{logical_device, create_info};
-    return std::move(shader_module);
-}
+    vk::DescriptorSetLayoutCreateInfo layout_info({}, bindings.size(), bindings.data());
 
-std::vector<char> Pipeline::readFile(const std::string& filename){
-    std::ifstream file(filename, std::ios::ate | std::ios::binary);
-    if(!file.is_open()){
-        throw std::runtime_error("failed to open file: " + filename);
-    }
-    size_t file_size = (size_t) file.tellg();
-    std::vector<char> buffer(file_size);
-    file.seekg(0);
-    file.read(buffer.data(), file_size);
-    file.close();
-    return buffer;
+    return std::move(vk::raii::DescriptorSetLayout(logical_device, layout_info));
 }
@@ -3,27 +3,35 @@
 #include "../Helpers/GeneralLibraries.hpp"
 
 namespace Pipeline{
-    // Creates a Raster Pipeline
+    // Creates a Raster Pipeline. The specialization constants select the variant of the shaders compiled into it.
+    // A shared set layout (the descriptor heap) replaces the one built from bindings and is not owned by the bundle.
+    // The vertex format selects the vertex input state
     RasterPipelineBundle createsRasterPipeline(const std::string &v_shader_path, const std::string &f_shader_path, 
                                 std::vector<vk::DescriptorSetLayoutBinding> *bindings, vk::CullModeFlags cull_mode, 
                                 vk::Format color_format, vk::Format depth_format, vk::SampleCountFlagBits &msaa_samples,
                                 std::string &name, vk::raii::DescriptorSetLayout *descriptor_set_layout,
-                                vk::raii::Device &logical_device);
+                                vk::raii::Device &logical_device, vk::raii::PipelineCache *pipeline_cache = nullptr,
+                                const SpecializationConstants &specialization = {},
+                                vk::DescriptorSetLayout shared_set_layout = nullptr,
+                                const std::vector<vk::PushConstantRange> &push_constant_ranges = {},
+                                VertexFormat vertex_format = VertexFormat::Full);
 
-    // Creates the Descriptor Set Layout of a pipeline given its bindings
-    vk::raii::DescriptorSetLayout createDescriptorSetLayout(std::vector<vk::DescriptorSetLayoutBinding> &bindings, const vk::raii::Device &logical_device);
-
-    // Creates the Descriptor Pool starting from the binding information
-    vk::raii::DescriptorPool createDescriptorPool(std::vector<vk::DescriptorSetLayoutBinding> &bindings, vk::raii::Device &logical_device, int max_frames_in_flight);
+    // Creates the pipeline object of a bundle, using its layout, states and specialization constants, from the given shader modules.
+    // Used on its own to rebuild a pipeline when its shaders change
+    vk::raii::Pipeline createPipelineObject(const RasterPipelineBundle &bundle, const vk::raii::ShaderModule &v_shader, const vk::raii::ShaderModule &f_shader,
+                                            vk::raii::Device &logical_device, vk::raii::PipelineCache *pipeline_cache);
 
-    // Creates the Descriptor Sets from given layout
-    std::vector<vk::raii::DescriptorSet> createDescriptorSets(vk::raii::DescriptorSetLayout &descriptor_set_layout, vk::raii::DescriptorPool &descriptor_pool, vk::raii::Device &logical_device, int max_frames_in_flight);
+    // Creates a Raster Pipeline from a self contained request. Thread safe: the cache is internally synchronized
+    RasterPipelineBundle createsRasterPipeline(RasterPipelineRequest &request, vk::raii::Device &logical_device, vk::raii::PipelineCache *pipeline_cache);
 
-    void writeDescriptorSets(const std::vector<vk::raii::DescriptorSet> &descriptor_sets, const std::vector<vk::DescriptorSetLayoutBinding> &bindings, const std::vector<void *> &resources, vk::raii::Device &logical_device, const int max_frames_in_flight);
+    // Creates the pipeline cache shared by every pipeline creation, filled with the content of path when it was saved
+    // by the same device and driver. Any mismatch or missing file gives an empty cache. loaded_size returns the bytes loaded
+    vk::raii::PipelineCache createPipelineCache(const vk::raii::PhysicalDevice &physical_device, const vk::raii::Device &logical_device,
+                                                const std::string &path, bool load, size_t &loaded_size);
 
-    // Generates the shader module from the .spv files
-    vk::raii::ShaderModule createShaderModule(const std::vector<char> &code, const vk::raii::Device &logical_device);
+    // Writes the pipeline cache to path, prefixed with the device identification checked on load
+    void savePipelineCache(const vk::raii::PipelineCache &pipeline_cache, const vk::raii::PhysicalDevice &physical_device, const std::string &path);
 
-    // Reades a file
-    std::vector<char> readFile(const std::string &filename);
+    // Creates the Descriptor Set Layout of a pipeline given its bindings
+    vk::raii::DescriptorSetLayout createDescriptorSetLayout(std::vector<vk::DescriptorSetLayoutBinding> &bindings, const vk::raii::Device &logical_device);
 }
\ No newline at end of file
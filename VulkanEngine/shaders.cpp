@@ -0,0 +1,227 @@
+#include "shaders.hpp"
+
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Identifies SPIR-V code: FNV-1a hash and size, so that a hash collision would also need the same length
+using ShaderKey = std::pair<uint64_t, size_t>;
+
+// What was loaded from a path, to skip reading it again while it is unchanged
+struct ShaderFileState{
+    int64_t modification_time = 0;
+    size_t size = 0;
+    ShaderKey key;
+};
+
+static std::mutex cache_mutex;
+static std::map<ShaderKey, std::shared_ptr<vk::raii::ShaderModule>> modules;
+static std::map<std::string, ShaderFileState> files;
+static uint32_t loads = 0;
+static uint32_t module_hits = 0;
+static uint32_t file_hits = 0;
+
+// FNV-1a, 64 bit. Good enough to tell shaders apart, not meant to be cryptographic
+static uint64_t hashCode(const uint8_t *data, size_t size){
+    uint64_t hash = 14695981039346656037ull;
+    for(size_t i = 0; i < size; i++){
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Read only mapping of a file, unmapped when going out of scope
+struct MappedFile{
+    void *data = MAP_FAILED;
+    size_t size = 0;
+
+    ~MappedFile(){
+        if(data != MAP_FAILED){
+            munmap(data, size);
+        }
+    }
+};
+
+// File descriptor closed when going out of scope, the mapping stays valid after closing it
+struct OpenFile{
+    int descriptor = -1;
+
+    ~OpenFile(){
+        if(descriptor >= 0){
+            close(descriptor);
+        }
+    }
+};
+
+std::shared_ptr<vk::raii::ShaderModule> ShaderCache::loadModule(const std::string &path, const vk::raii::Device &logical_device)
+{
+    // Size and time come from the opened file: a rename by the hot reload or a rewrite between a stat of the path and
+    // the open could otherwise give a mapping longer than the file, and reading past its end raises SIGBUS
+    OpenFile file_handle;
+    file_handle.descriptor = open(path.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if(file_handle.descriptor < 0 || fstat(file_handle.descriptor, &file_stat) != 0){
+        throw std::runtime_error("failed to open file: " + path);
+    }
+    int64_t modification_time = static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1000000000ll + file_stat.st_mtim.tv_nsec;
+    size_t size = static_cast<size_t>(file_stat.st_size);
+
+    if(size == 0 || size % sizeof(uint32_t) != 0){
+        throw std::runtime_error("invalid SPIR-V file: " + path);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        loads++;
+        auto file = files.find(path);
+        if(file != files.end() && file -> second.modification_time == modification_time && file -> second.size == size){
+            auto module = modules.find(file -> second.key);
+            if(module != modules.end()){
+                file_hits++;
+                return module -> second;
+            }
+        }
+    }
+
+    MappedFile mapped;
+    mapped.size = size;
+    mapped.data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file_handle.descriptor, 0);
+    if(mapped.data == MAP_FAILED){
+        throw std::runtime_error("failed to map file: " + path);
+    }
+
+    ShaderKey key(hashCode(static_cast<const uint8_t*>(mapped.data), size), size);
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        files[path] = ShaderFileState{modification_time, size, key};
+        auto module = modules.find(key);
+        if(module != modules.end()){
+            module_hits++;
+            return module -> second;
+        }
+    }
+
+    // Created outside of the lock, so that pipelines built in parallel don't serialize on module creation
+    vk::ShaderModuleCreateInfo create_info;
+    create_info.codeSize = size;
+    create_info.pCode = static_cast<const uint32_t*>(mapped.data);
+    auto module = std::make_shared<vk::raii::ShaderModule>(logical_device, create_info);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    // Another thread may have created the same module meanwhile, the first one inserted wins
+    return modules.emplace(key, std::move(module)).first -> second;
+}
+
+void ShaderCache::printStats()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::cout << "Shader cache: " << loads << " loads, " << modules.size() << " resident modules, "
+              << file_hits << " served without reading the file, " << module_hits << " deduplicated by content" << std::endl;
+}
+
+void ShaderCache::releaseUnused()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    std::erase_if(modules, [](const auto &entry){
+        return entry.second.use_count() == 1;
+    });
+}
+
+void ShaderCache::clear()
+{
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    modules.clear();
+    files.clear();
+}
+
+bool ShaderCache::compile(const std::string &source, const std::string &output, std::string &log)
+{
+    // Compiled next to the destination and renamed, so a failed compilation keeps the previous SPIR-V
+    const std::string temp_output = output + ".tmp";
+    const std::string command = "glslc \"" + source + "\" -o \"" + temp_output + "\" 2>&1";
+
+    FILE *pipe = popen(command.c_str(), "r");
+    if(pipe == nullptr){
+        log = "failed to run glslc";
+        return false;
+    }
+
+    std::array<char, 256> line;
+    while(fgets(line.data(), line.size(), pipe) != nullptr){
+        log += line.data();
+    }
+
+    if(pclose(pipe) != 0){
+        std::remove(temp_output.c_str());
+        return false;
+    }
+
+    return std::rename(temp_output.c_str(), output.c_str()) == 0;
+}
+
+void ShaderWatcher::start(const std::string &root, std::chrono::milliseconds interval)
+{
+    this -> root = root;
+    stopping = false;
+    scan(false);
+
+    thread = std::thread([this, interval](){
+        std::unique_lock<std::mutex> lock(mutex);
+        while(!stop_cv.wait_for(lock, interval, [this]{ return stopping; })){
+            lock.unlock();
+            scan(true);
+            lock.lock();
+        }
+    });
+}
+
+void ShaderWatcher::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stop_cv.notify_all();
+
+    if(thread.joinable()){
+        thread.join();
+    }
+}
+
+std::vector<std::string> ShaderWatcher::takeChanges()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return std::exchange(changes, {});
+}
+
+void ShaderWatcher::scan(bool report)
+{
+    std::error_code error;
+    for(auto it = std::filesystem::recursive_directory_iterator(root, error); !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)){
+        const std::filesystem::path &path = it -> path();
+        if(!it -> is_regular_file(error) || (path.extension() != ".vert" && path.extension() != ".frag")){
+            continue;
+        }
+
+        std::filesystem::file_time_type write_time = std::filesystem::last_write_time(path, error);
+        if(error){
+            continue; // The file may be in the middle of being saved, it will be checked again
+        }
+
+        const std::string source = path.lexically_normal().generic_string();
+        auto timestamp = timestamps.find(source);
+        if(timestamp == timestamps.end() || timestamp -> second != write_time){
+            timestamps[source] = write_time;
+            if(report){
+                std::lock_guard<std::mutex> lock(mutex);
+                if(std::find(changes.begin(), changes.end(), source) == changes.end()){
+                    changes.push_back(source);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "../Helpers/GeneralLibraries.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <filesystem>
+
+namespace ShaderCache{
+    // Returns the shader module of a SPIR-V file. The file is memory mapped instead of copied, and modules are
+    // deduplicated by content hash: pipelines loading the same code, from any path, share one resident module.
+    // Unchanged files (same size and modification time) are not read again. Thread safe
+    std::shared_ptr<vk::raii::ShaderModule> loadModule(const std::string &path, const vk::raii::Device &logical_device);
+
+    // Prints how many loads were served by the cache
+    void printStats();
+
+    // Drops the modules no pipeline uses anymore, e.g. the previous version of a reloaded shader
+    void releaseUnused();
+
+    // Releases every cached module. Must be called before destroying the device
+    void clear();
+
+    // Compiles a GLSL source to SPIR-V with glslc. The output is replaced only on success, log receives the compiler messages
+    bool compile(const std::string &source, const std::string &output, std::string &log);
+}
+
+// Watches a directory tree for modified GLSL sources (.vert, .frag), polling on its own thread
+class ShaderWatcher{
+public:
+    ShaderWatcher() = default;
+    ~ShaderWatcher(){
+        stop();
+    }
+
+    // Disable copying and moving, the thread keeps a pointer to the watcher
+    ShaderWatcher(const ShaderWatcher&) = delete;
+    ShaderWatcher& operator=(const ShaderWatcher&) = delete;
+
+    // Records the current sources and starts polling every interval
+    void start(const std::string &root, std::chrono::milliseconds interval);
+
+    // Stops and joins the polling thread
+    void stop();
+
+    // Returns the sources modified since the last call, as normalized paths
+    std::vector<std::string> takeChanges();
+
+private:
+    std::thread thread;
+    std::mutex mutex; // Protects changes and stopping
+    std::condition_variable stop_cv;
+    bool stopping = false;
+    std::string root;
+    std::map<std::string, std::filesystem::file_time_type> timestamps; // Only used by the polling thread after start
+    std::vector<std::string> changes;
+
+    // Compares the sources with the recorded timestamps, queuing the modified ones if report is true
+    void scan(bool report);
+};
@@ -1,14 +1,15 @@
 #include "swapchain.hpp"
 
-SwapchainBundle Swapchain::createSwapchain(vk::raii::PhysicalDevice &physical_device, vk::raii::Device& logical_device, vk::raii::SurfaceKHR &surface, GLFWwindow * window, QueuePool& queue_indices){
+SwapchainBundle Swapchain::createSwapchain(vk::raii::PhysicalDevice &physical_device, vk::raii::Device& logical_device, vk::raii::SurfaceKHR &surface, GLFWwindow * window, QueuePool& queue_indices,
+                                            vk::PresentModeKHR preferred_present_mode, uint32_t preferred_image_count, vk::SwapchainKHR old_swapchain){
     SwapchainBundle swapchain;
 
     vk::SurfaceCapabilitiesKHR surface_capabilities = physical_device.getSurfaceCapabilitiesKHR(surface);
     swapchain.format = chooseSwapSurfaceFormat(physical_device.getSurfaceFormatsKHR(surface));
     swapchain.extent = chooseSwapExtent(surface_capabilities, window);
-    swapchain.present_mode = chooseSwapPresentMode(physical_device.getSurfacePresentModesKHR(surface));
+    swapchain.present_mode = chooseSwapPresentMode(physical_device.getSurfacePresentModesKHR(surface), preferred_present_mode);
 
-    auto min_image_count = std::max(3u, surface_capabilities.minImageCount);
+    auto min_image_count = std::max(preferred_image_count, surface_capabilities.minImageCount);
     min_image_count = (surface_capabilities.maxImageCount > 0 && min_image_count > surface_capabilities.maxImageCount) 
                     ? surface_capabilities.maxImageCount : min_image_count; // maxImageCount == 0 indicates no limit on images count
 
@@ -30,6 +31,7 @@ SwapchainBundle Swapchain::createSwapchain(vk::raii::PhysicalDevice &physical_de
     swapchain_create_info.presentMode = swapchain.present_mode;
     swapchain_create_info.clipped = true; // If a pixel is obscured by another window, Vulkan won't bother rendering it.
     swapchain_create_info.imageExtent = swapchain.extent;
+    swapchain_create_info.oldSwapchain = old_swapchain; // Images of the old swapchain already queued for presentation are still presented
 
     if(queue_family_indices[0] != queue_family_indices[1]){
         // Allows multiple queue families to access the images simultaneously without explicit ownership tansfers. Easier to code but less performant
@@ -100,8 +102,8 @@ vk::Extent2D Swapchain::chooseSwapExtent(const vk::SurfaceCapabilitiesKHR& capab
     };
 }
 
-vk::PresentModeKHR Swapchain::chooseSwapPresentMode(const std::vector<vk::PresentModeKHR>& available_present_modes){
-    return std::ranges::any_of(available_present_modes, [](const vk::PresentModeKHR value){
-        return vk::PresentModeKHR::eMailbox == value;
-    }) ? vk::PresentModeKHR::eMailbox : vk::PresentModeKHR::eFifo;
+vk::PresentModeKHR Swapchain::chooseSwapPresentMode(const std::vector<vk::PresentModeKHR>& available_present_modes, vk::PresentModeKHR preferred_present_mode){
+    return std::ranges::any_of(available_present_modes, [preferred_present_mode](const vk::PresentModeKHR value){
+        return preferred_present_mode == value;
+    }) ? preferred_present_mode : vk::PresentModeKHR::eFifo;
 }
\ No newline at end of file
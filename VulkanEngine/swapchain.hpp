@@ -4,12 +4,14 @@
 #include "../Helpers/GLFWhelper.hpp"
 
 namespace Swapchain{
-    SwapchainBundle createSwapchain(vk::raii::PhysicalDevice &physical_device, vk::raii::Device& logical_device, vk::raii::SurfaceKHR &surface, GLFWwindow * window, QueuePool& queue_indices);
+    // Creates the swapchain and its image views. When recreating, old_swapchain is handed over so the driver can reuse its resources
+    SwapchainBundle createSwapchain(vk::raii::PhysicalDevice &physical_device, vk::raii::Device& logical_device, vk::raii::SurfaceKHR &surface, GLFWwindow * window, QueuePool& queue_indices,
+                                    vk::PresentModeKHR preferred_present_mode, uint32_t preferred_image_count, vk::SwapchainKHR old_swapchain = nullptr);
 
     // Helper function to extract a suitable format for the swapchain
     vk::Format chooseSwapSurfaceFormat(std::vector<vk::SurfaceFormatKHR> available_formats);
     // Helper function to select a correct Extent for the swapchain images
     vk::Extent2D chooseSwapExtent(const vk::SurfaceCapabilitiesKHR &capabilities, GLFWwindow *window);
-    // Helper function to choose the best possible present mode
-    vk::PresentModeKHR chooseSwapPresentMode(const std::vector<vk::PresentModeKHR> &available_present_modes);
+    // Helper function to choose the present mode. Returns the preferred one if available, Fifo (always supported) otherwise
+    vk::PresentModeKHR chooseSwapPresentMode(const std::vector<vk::PresentModeKHR> &available_present_modes, vk::PresentModeKHR preferred_present_mode);
 };
\ No newline at end of file
@@ -0,0 +1,53 @@
+#include "sync.hpp"
+
+Timeline Sync::createTimeline(const vk::raii::Device &logical_device)
+{
+    vk::SemaphoreTypeCreateInfo type_info{};
+    type_info.semaphoreType = vk::SemaphoreType::eTimeline;
+    type_info.initialValue = 0;
+
+    vk::SemaphoreCreateInfo semaphore_info{};
+    semaphore_info.pNext = &type_info;
+
+    Timeline timeline;
+    timeline.semaphore = vk::raii::Semaphore(logical_device, semaphore_info);
+    timeline.value = 0;
+
+    return timeline;
+}
+
+uint64_t Sync::nextValue(Timeline &timeline)
+{
+    return ++timeline.value;
+}
+
+bool Sync::isComplete(const Timeline &timeline, uint64_t value)
+{
+    return timeline.semaphore.getCounterValue() >= value;
+}
+
+void Sync::wait(const Timeline &timeline, uint64_t value, const vk::raii::Device &logical_device)
+{
+    if(value == 0){
+        return; // Nothing has been submitted yet
+    }
+
+    vk::SemaphoreWaitInfo wait_info{};
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &*timeline.semaphore;
+    wait_info.pValues = &value;
+
+    if(logical_device.waitSemaphores(wait_info, UINT64_MAX) != vk::Result::eSuccess){
+        throw std::runtime_error("failed to wait for timeline semaphore!");
+    }
+}
+
+vk::SemaphoreSubmitInfo Sync::submitInfo(const Timeline &timeline, uint64_t value, vk::PipelineStageFlags2 stage_mask)
+{
+    vk::SemaphoreSubmitInfo submit_info{};
+    submit_info.semaphore = *timeline.semaphore;
+    submit_info.value = value;
+    submit_info.stageMask = stage_mask;
+
+    return submit_info;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "../Helpers/GeneralLibraries.hpp"
+
+namespace Sync{
+    // Creates a timeline semaphore starting at 0
+    Timeline createTimeline(const vk::raii::Device &logical_device);
+
+    // Reserves the value signaled by the next submission on the timeline
+    uint64_t nextValue(Timeline &timeline);
+
+    // Returns true if the GPU has reached value on the timeline, without blocking
+    bool isComplete(const Timeline &timeline, uint64_t value);
+
+    // Blocks until the GPU reaches value on the timeline. The wait happens in the driver, no polling
+    void wait(const Timeline &timeline, uint64_t value, const vk::raii::Device &logical_device);
+
+    // Describes a wait or signal of value on the timeline, for vk::SubmitInfo2
+    vk::SemaphoreSubmitInfo submitInfo(const Timeline &timeline, uint64_t value, vk::PipelineStageFlags2 stage_mask);
+}
@@ -0,0 +1,266 @@
+#include "transforms.hpp"
+
+#include "gameobject.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+// The vector helpers are internal and inlined, the ABI note about passing 32 byte vectors without AVX does not apply
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+namespace{
+    // Block of LANES floats. GCC and Clang lower the operations to the widest registers enabled by the target flags
+    // (-mavx2, NEON), or to pairs of SSE registers with the default x86-64 flags
+    typedef float Lanes __attribute__((vector_size(TransformStore::LANES * sizeof(float))));
+    typedef int32_t LaneInts __attribute__((vector_size(TransformStore::LANES * sizeof(int32_t))));
+
+    // The arrays are only float aligned
+    inline Lanes load(const float *source){
+        Lanes value;
+        memcpy(&value, source, sizeof(Lanes));
+        return value;
+    }
+
+    inline void store(float *destination, Lanes value){
+        memcpy(destination, &value, sizeof(Lanes));
+    }
+
+    // Rounds to the nearest integer, exact below 2^22: adding 1.5 * 2^23 pushes the fraction out of the mantissa
+    inline Lanes roundLanes(Lanes value){
+        const float magic = 12582912.f;
+        return (value + magic) - magic;
+    }
+
+    // Bitwise mask ? a : b, mask lanes are all ones or all zeros
+    inline Lanes select(LaneInts mask, Lanes a, Lanes b){
+        return (Lanes)(((LaneInts)a & mask) | ((LaneInts)b & ~mask));
+    }
+
+    inline Lanes negateIf(LaneInts mask, Lanes value){
+        return (Lanes)((LaneInts)value ^ (mask & INT32_MIN));
+    }
+
+    inline Lanes wrapDegrees(Lanes degrees){
+        return degrees - roundLanes(degrees * (1.f / 360.f)) * 360.f;
+    }
+
+    // Sine and cosine of angles in degrees, reduced to [-45, 45] around the nearest quadrant and evaluated with the
+    // minimax polynomials of Cephes sinf/cosf. Error around 1e-7, branch free
+    inline void sinCosDegrees(Lanes degrees, Lanes &sine, Lanes &cosine){
+        Lanes quadrant = roundLanes(degrees * (1.f / 90.f));
+        Lanes x = (degrees - quadrant * 90.f) * (glm::pi<float>() / 180.f);
+        Lanes x2 = x * x;
+
+        Lanes s = x + x * x2 * (-1.6666654611e-1f + x2 * (8.3321608736e-3f + x2 * -1.9515295891e-4f));
+        Lanes c = 1.f - .5f * x2 + x2 * x2 * (4.166664568298827e-2f + x2 * (-1.388731625493765e-3f + x2 * 2.443315711809948e-5f));
+
+        // Quadrant q: sine is (s, c, -s, -c)[q & 3], cosine is (c, -s, -c, s)[q & 3]
+        LaneInts q = __builtin_convertvector(quadrant, LaneInts);
+        LaneInts swap = (q & 1) != 0;
+        sine = negateIf((q & 2) != 0, select(swap, c, s));
+        cosine = negateIf(((q + 1) & 2) != 0, select(swap, s, c));
+    }
+}
+
+uint32_t TransformStore::add(glm::vec3 position, glm::vec3 scale, glm::vec3 rotation, glm::vec3 dis_speed, glm::vec3 rot_speed, glm::vec3 scale_speed)
+{
+    // A new block of zeros: the padding is integrated and computed like any other object, never read back
+    if(object_count % LANES == 0){
+        for(auto &component : components){
+            for(std::vector<float> &axis : component){
+                axis.resize(object_count + LANES, 0.f);
+            }
+        }
+    }
+
+    uint32_t index = static_cast<uint32_t>(object_count++);
+    set(POSITION, index, position);
+    set(ROTATION, index, rotation);
+    set(SCALE, index, scale);
+    set(DIS_SPEED, index, dis_speed);
+    set(ROT_SPEED, index, rot_speed);
+    set(SCALE_SPEED, index, scale_speed);
+    return index;
+}
+
+void TransformStore::reserve(size_t object_count)
+{
+    size_t padded = (object_count + LANES - 1) / LANES * LANES;
+    for(auto &component : components){
+        for(std::vector<float> &axis : component){
+            axis.reserve(padded);
+        }
+    }
+}
+
+void TransformStore::clear()
+{
+    for(auto &component : components){
+        for(std::vector<float> &axis : component){
+            axis.clear();
+        }
+    }
+    object_count = 0;
+}
+
+glm::vec3 TransformStore::getPosition(uint32_t index) const{ return get(POSITION, index); }
+glm::vec3 TransformStore::getRotation(uint32_t index) const{ return get(ROTATION, index); }
+glm::vec3 TransformStore::getScale(uint32_t index) const{ return get(SCALE, index); }
+void TransformStore::setPosition(uint32_t index, glm::vec3 position){ set(POSITION, index, position); }
+void TransformStore::setRotation(uint32_t index, glm::vec3 rotation){ set(ROTATION, index, rotation); }
+void TransformStore::setScale(uint32_t index, glm::vec3 scale){ set(SCALE, index, scale); }
+
+glm::vec3 TransformStore::get(Component component, uint32_t index) const
+{
+    return glm::vec3(components[component][0][index], components[component][1][index], components[component][2][index]);
+}
+
+void TransformStore::set(Component component, uint32_t index, glm::vec3 value)
+{
+    for(int axis = 0; axis < 3; axis++){
+        components[component][axis][index] = value[axis];
+    }
+}
+
+void TransformStore::checkRange(size_t first, size_t count) const
+{
+    size_t end = first + count;
+    if(end > object_count || first % LANES != 0 || (end % LANES != 0 && end != object_count)){
+        throw std::runtime_error("Invalid transform range [" + std::to_string(first) + ", " + std::to_string(end) + ") of " +
+                                 std::to_string(object_count) + " objects, ranges must start and end on blocks of " + std::to_string(LANES));
+    }
+}
+
+void TransformStore::integrate(float dtime, size_t first, size_t count)
+{
+    checkRange(first, count);
+    size_t end = first + count;
+
+    for(int axis = 0; axis < 3; axis++){
+        float *position = components[POSITION][axis].data();
+        float *rotation = components[ROTATION][axis].data();
+        float *scale = components[SCALE][axis].data();
+        const float *dis_speed = components[DIS_SPEED][axis].data();
+        const float *rot_speed = components[ROT_SPEED][axis].data();
+        const float *scale_speed = components[SCALE_SPEED][axis].data();
+
+        for(size_t i = first; i < end; i += LANES){
+            store(position + i, load(position + i) + load(dis_speed + i) * dtime);
+            store(rotation + i, wrapDegrees(load(rotation + i) + load(rot_speed + i) * dtime));
+            store(scale + i, load(scale + i) + load(scale_speed + i) * dtime);
+        }
+    }
+}
+
+void TransformStore::computeModels(glm::mat4 *models, size_t first, size_t count) const
+{
+    checkRange(first, count);
+    size_t end = first + count;
+
+    for(size_t i = first; i < end; i += LANES){
+        Lanes sin_x, cos_x, sin_y, cos_y, sin_z, cos_z;
+        sinCosDegrees(load(components[ROTATION][0].data() + i), sin_x, cos_x);
+        sinCosDegrees(load(components[ROTATION][1].data() + i), sin_y, cos_y);
+        sinCosDegrees(load(components[ROTATION][2].data() + i), sin_z, cos_z);
+
+        // Rx * Ry * Rz expanded, as glm::rotate applies them one after the other
+        Lanes sin_x_sin_y = sin_x * sin_y;
+        Lanes cos_x_sin_y = cos_x * sin_y;
+        Lanes scale_x = load(components[SCALE][0].data() + i);
+        Lanes scale_y = load(components[SCALE][1].data() + i);
+        Lanes scale_z = load(components[SCALE][2].data() + i);
+
+        // First three columns scaled, then the translation
+        std::array<Lanes, 12> columns = {
+            cos_y * cos_z * scale_x,
+            (cos_x * sin_z + sin_x_sin_y * cos_z) * scale_x,
+            (sin_x * sin_z - cos_x_sin_y * cos_z) * scale_x,
+
+            -cos_y * sin_z * scale_y,
+            (cos_x * cos_z - sin_x_sin_y * sin_z) * scale_y,
+            (sin_x * cos_z + cos_x_sin_y * sin_z) * scale_y,
+
+            sin_y * scale_z,
+            -sin_x * cos_y * scale_z,
+            cos_x * cos_y * scale_z,
+
+            load(components[POSITION][0].data() + i),
+            load(components[POSITION][1].data() + i),
+            load(components[POSITION][2].data() + i)
+        };
+
+        // Transposed into one matrix per object, the padding of the last block is not written
+        size_t lanes = std::min(LANES, end - i);
+        for(size_t lane = 0; lane < lanes; lane++){
+            glm::mat4 &model = models[i - first + lane];
+            model[0] = glm::vec4(columns[0][lane], columns[1][lane], columns[2][lane], 0.f);
+            model[1] = glm::vec4(columns[3][lane], columns[4][lane], columns[5][lane], 0.f);
+            model[2] = glm::vec4(columns[6][lane], columns[7][lane], columns[8][lane], 0.f);
+            model[3] = glm::vec4(columns[9][lane], columns[10][lane], columns[11][lane], 1.f);
+        }
+    }
+}
+
+void TransformStore::benchmark(const std::vector<uint32_t> &object_counts)
+{
+    const int iterations = 20;
+    const float dtime = 16.f;
+
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> unit(-1.f, 1.f);
+    auto random_vec3 = [&random, &unit](float range){
+        return glm::vec3(unit(random), unit(random), unit(random)) * range;
+    };
+
+    std::cout << "TRANSFORM BENCHMARK, " << iterations << " frames, lanes: " << LANES << std::endl;
+    for(uint32_t object_count : object_counts){
+        // The same objects in both layouts
+        std::vector<Gameobject> objects;
+        TransformStore store;
+        objects.reserve(object_count);
+        store.reserve(object_count);
+        for(uint32_t i = 0; i < object_count; i++){
+            glm::vec3 position = random_vec3(100.f);
+            glm::vec3 scale = glm::vec3(1.f) + random_vec3(.5f);
+            glm::vec3 rotation = random_vec3(180.f);
+            glm::vec3 dis_speed = random_vec3(.01f);
+            glm::vec3 rot_speed = random_vec3(.1f);
+            glm::vec3 scale_speed = random_vec3(.0001f);
+            objects.emplace_back(position, scale, rotation, dis_speed, rot_speed, scale_speed);
+            store.add(position, scale, rotation, dis_speed, rot_speed, scale_speed);
+        }
+        std::vector<glm::mat4> object_models(object_count);
+        std::vector<glm::mat4> store_models(object_count);
+
+        // Current path: updateObjects then prepareFrame
+        auto start = std::chrono::high_resolution_clock::now();
+        for(int iteration = 0; iteration < iterations; iteration++){
+            for(Gameobject &object : objects){
+                object.update(dtime);
+            }
+            for(uint32_t i = 0; i < object_count; i++){
+                object_models[i] = objects[i].getModelMat();
+            }
+        }
+        double objects_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+
+        start = std::chrono::high_resolution_clock::now();
+        for(int iteration = 0; iteration < iterations; iteration++){
+            store.integrate(dtime);
+            store.computeModels(store_models.data(), 0, object_count);
+        }
+        double store_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+
+        float max_difference = 0.f;
+        for(uint32_t i = 0; i < object_count; i++){
+            for(int column = 0; column < 4; column++){
+                glm::vec4 difference = glm::abs(object_models[i][column] - store_models[i][column]);
+                max_difference = std::max({max_difference, difference.x, difference.y, difference.z, difference.w});
+            }
+        }
+
+        std::cout << object_count << " objects: Gameobject " << objects_ms << " ms, TransformStore " << store_ms
+                  << " ms per frame (" << objects_ms / store_ms << "x), max difference " << max_difference << std::endl;
+    }
+}
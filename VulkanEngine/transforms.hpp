@@ -0,0 +1,61 @@
+#pragma once
+
+#include "../Helpers/GeneralLibraries.hpp"
+
+// Transforms of many objects as structure of arrays: one contiguous float array per component and axis instead of one
+// Gameobject per transform. Integration and model matrices run over blocks of LANES objects with vector instructions,
+// one AVX2 register (or two SSE ones) on x86, two NEON registers on ARM, and without branches on the rotation angles.
+// The model matrix is the one of Gameobject: translation, rotations around x, y and z in degrees, then scale
+class TransformStore{
+public:
+    static constexpr size_t LANES = 8;
+
+    TransformStore() = default;
+
+    // Adds an object and returns its index
+    uint32_t add(glm::vec3 position, glm::vec3 scale = glm::vec3(1), glm::vec3 rotation = glm::vec3(0),
+                 glm::vec3 dis_speed = glm::vec3(0), glm::vec3 rot_speed = glm::vec3(0), glm::vec3 scale_speed = glm::vec3(0));
+
+    void reserve(size_t object_count);
+    void clear();
+
+    size_t size() const{
+        return object_count;
+    }
+
+    glm::vec3 getPosition(uint32_t index) const;
+    glm::vec3 getRotation(uint32_t index) const;
+    glm::vec3 getScale(uint32_t index) const;
+    void setPosition(uint32_t index, glm::vec3 position);
+    void setRotation(uint32_t index, glm::vec3 rotation);
+    void setScale(uint32_t index, glm::vec3 scale);
+
+    // Moves, rotates and scales the objects in [first, first + count) by their speeds times dtime. Rotations are wrapped
+    // to [-180, 180] degrees so that they never lose precision. Ranges starting and ending at multiples of LANES (or at
+    // the end of the store) can be integrated concurrently
+    void integrate(float dtime, size_t first, size_t count);
+    void integrate(float dtime){
+        integrate(dtime, 0, object_count);
+    }
+
+    // Writes the model matrices of the objects in [first, first + count) in models[0, count), e.g. directly in the frame
+    // arena. Same range rules as integrate
+    void computeModels(glm::mat4 *models, size_t first, size_t count) const;
+
+    // Times integrate + computeModels against Gameobject::update + getModelMat for each object count and prints the
+    // results, with the largest difference between the matrices of the two paths
+    static void benchmark(const std::vector<uint32_t> &object_counts);
+
+private:
+    enum Component{POSITION, ROTATION, SCALE, DIS_SPEED, ROT_SPEED, SCALE_SPEED, COMPONENT_COUNT};
+
+    // [component][axis][object], padded to a multiple of LANES so that every block is complete
+    std::array<std::array<std::vector<float>, 3>, COMPONENT_COUNT> components;
+    size_t object_count = 0;
+
+    glm::vec3 get(Component component, uint32_t index) const;
+    void set(Component component, uint32_t index, glm::vec3 value);
+
+    // Throws when a range exceeds the store or splits a block that another range could be processing
+    void checkRange(size_t first, size_t count) const;
+};
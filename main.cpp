@@ -1,4 +1,76 @@
 #include "scene.hpp"
+#include "VulkanEngine/transforms.hpp"
+
+#include <charconv>
+#include <cstring>
+
+// Parses the whole argument as an integer in [min, max], throws otherwise
+int parseInt(const std::string &option, const char *value, int min, int max){
+    const char *end = value + std::strlen(value);
+    int result = 0;
+    auto [last, error] = std::from_chars(value, end, result);
+    if(error != std::errc() || last != end || result < min || result > max){
+        throw std::runtime_error("Invalid value for " + option + ": " + std::string(value) + ", expected an integer from " +
+                                 std::to_string(min) + " to " + std::to_string(max));
+    }
+    return result;
+}
+
+// Parses the options following title and dimensions:
+// --frames <1-4>, --present <mailbox|fifo|fifo_relaxed|immediate>, --images <count>, --no-latency, --threads <count>, --no-async-compute,
+// --cold-cache (ignores the saved pipeline cache), --no-hot-reload, --bench-transforms
+EngineConfig parseConfig(int argc, char * argv[], int first){
+    EngineConfig config;
+
+    const std::map<std::string, vk::PresentModeKHR> present_modes{
+        {"mailbox", vk::PresentModeKHR::eMailbox},
+        {"fifo", vk::PresentModeKHR::eFifo},
+        {"fifo_relaxed", vk::PresentModeKHR::eFifoRelaxed},
+        {"immediate", vk::PresentModeKHR::eImmediate}
+    };
+
+    for(int i = first; i < argc; ++i){
+        const std::string option = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if(option == "--frames" && has_value){
+            config.frames_in_flight = parseInt(option, argv[++i], 1, 4);
+        }
+        else if(option == "--present" && has_value){
+            auto mode = present_modes.find(argv[++i]);
+            if(mode == present_modes.end()){
+                throw std::runtime_error("Unknown present mode: " + std::string(argv[i]));
+            }
+            config.present_mode = mode -> second;
+        }
+        else if(option == "--images" && has_value){
+            config.swapchain_images = parseInt(option, argv[++i], 1, 16);
+        }
+        else if(option == "--threads" && has_value){
+            config.worker_threads = parseInt(option, argv[++i], -1, 256);
+        }
+        else if(option == "--no-latency"){
+            config.measure_latency = false;
+        }
+        else if(option == "--no-async-compute"){
+            config.async_compute = false;
+        }
+        else if(option == "--cold-cache"){
+            config.load_pipeline_cache = false;
+        }
+        else if(option == "--no-hot-reload"){
+            config.hot_reload = false;
+        }
+        else if(option == "--bench-transforms"){
+            config.bench_transforms = true;
+        }
+        else{
+            throw std::runtime_error("Unknown or incomplete option: " + option);
+        }
+    }
+
+    return config;
+}
 
 int main(int argc, char * argv[]){
     Scene scene;
@@ -7,15 +79,23 @@ int main(int argc, char * argv[]){
     // Extracting title from input
     const std::string title = argv[1];
 
-    // Extracting dimensions from input
-    for(size_t i = 2; i < argc; ++i){
+    // Extracting dimensions from input, options start with the first "--" argument
+    int i = 2;
+    for(; i < argc && i < 4 && std::string(argv[i]).rfind("--", 0) != 0; ++i){
         dimensions[i-2] = std::atoi(argv[i]);
     }
 
-    scene.init(title, dimensions[0], dimensions[1]);
+    EngineConfig config = parseConfig(argc, argv, i);
+
+    if(config.bench_transforms){
+        TransformStore::benchmark({10000, 100000, 1000000});
+        return 0;
+    }
+
+    scene.init(title, dimensions[0], dimensions[1], config);
 
     scene.run();
 
 
     scene.cleanup();
-}
\ No newline at end of file
+}
@@ -6,224 +6,150 @@ void Scene::createInitResources(){
     base_light_intensity = 500000.f;
     intensity_divisor = 10;
     light_threshold = 0.1;
+    background_jobs.start(1);
 
-    // Reserving memory for all cubes, instantiating only for one
-    cube_positions.resize(MAX_CUBES);
-    temp_positions.resize(MAX_CUBES);
-    centers_and_levels.resize(MAX_LIGHTS);
-
-    main_cube = Cube(center, glm::vec3(cube_size), glm::vec3(0.0f), glm::vec3(0.0f), rot_speed, glm::vec3(0.0), center, true);
-    main_cube.start(vma_allocator, logical_device, queue_pool);
-
-    cube_positions[0] = center;
-
-    // The UBO containing the per-cube info
-    cube_ssbo_mapped.clear();
-    cube_ssbo_mapped.resize(queue_pool.max_frames_in_flight);
-    vk::DeviceSize gameobject_buffer_size = sizeof(CubeBuffer);
-    for(size_t i = 0; i < queue_pool.max_frames_in_flight; i++){
-        cube_ssbo_mapped[i].buffer = Device::createBuffer(
-            sizeof(glm::vec4) * MAX_CUBES,
-            vk::BufferUsageFlagBits::eTransferSrc,
-            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-            "Gameobject SSBO Mapped",
-            vma_allocator
-        );
-        vmaMapMemory(vma_allocator, cube_ssbo_mapped[i].buffer.allocation, &cube_ssbo_mapped[i].data);
+    // The pipeline variants compile on the workers while the first level is created and uploaded
+    std::vector<std::future<RasterPipelineBundle>> variant_builds;
+    for(uint32_t variant = 0; variant < MENGER_VARIANTS; variant++){
+        variant_builds.push_back(buildRasterPipeline(makeVariantRequest(variant)));
     }
 
-    cube_ssbo.clear();
-    cube_ssbo.resize(queue_pool.max_frames_in_flight);
-    for(size_t i = 0; i < queue_pool.max_frames_in_flight; i++){
-        cube_ssbo[i].buffer = Device::createBuffer(
-            sizeof(glm::vec4) * MAX_CUBES,
-            vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
-            vk::MemoryPropertyFlagBits::eDeviceLocal,
-            "Gameobject SSBO",
-            vma_allocator
-        );
-    }
-
-    single_cube_ubo.clear();
-    single_cube_ubo.resize(queue_pool.max_frames_in_flight);
-    vk::DeviceSize single_cubo_ubo_size = sizeof(FirstCubeBuffer);
-    for(size_t i = 0; i < queue_pool.max_frames_in_flight; i++){
-        single_cube_ubo[i].buffer = Device::createBuffer(
-            single_cubo_ubo_size,
-            vk::BufferUsageFlagBits::eUniformBuffer,
-            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-            "Main Cube Buffer",
-            vma_allocator
-        );
-        vmaMapMemory(vma_allocator, single_cube_ubo[i].buffer.allocation, &single_cube_ubo[i].data);
-    }
+    // Only the first level is instantiated, containers and buffers grow together with the menger level
+    cube_positions.assign(1, center);
+    centers_and_levels.clear();
 
-    // LIGHTS SETUP
-    light_ssbo_mapped.clear();
-    light_ssbo_mapped.resize(queue_pool.max_frames_in_flight);
-    vk::DeviceSize light_size = sizeof(glm::vec4) + sizeof(PointLightBuffer) * MAX_LIGHTS;
-    for(size_t i = 0; i < queue_pool.max_frames_in_flight; i++){
-        light_ssbo_mapped[i].buffer = Device::createBuffer(
-            light_size,
-            vk::BufferUsageFlagBits::eTransferSrc,
-            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-            "Lights SSBO mapped",
-            vma_allocator
-        );
-        vmaMapMemory(vma_allocator, light_ssbo_mapped[i].buffer.allocation, &light_ssbo_mapped[i].data);
-    }
+    main_cube = Cube(center, glm::vec3(cube_size), glm::vec3(0.0f), glm::vec3(0.0f), rot_speed, glm::vec3(0.0), center, true);
+    // Tens of millions of instanced vertices are fetched per frame: compact vertices, the cube color is pushed instead
+    main_cube.setVertexFormat(VertexFormat::Compact);
+    main_cube.start(mesh_pool, vma_allocator, logical_device, queue_pool);
+    frame_constants.base_color = glm::packUnorm4x8(glm::vec4(glm::vec3(0.5f), 1.0f));
 
+    // The SSBOs containing the per-cube info and the lights. They are only written by level transitions, so instead of a copy
+    // per frame there are two slots: the active level and the pending one being uploaded
+    cube_ssbo.clear();
+    cube_ssbo.resize(2);
     light_ssbo.clear();
-    light_ssbo.resize(queue_pool.max_frames_in_flight);
-    for(size_t i = 0; i < queue_pool.max_frames_in_flight; i++){
-        light_ssbo[i].buffer = Device::createBuffer(
-            light_size,
-            vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
-            vk::MemoryPropertyFlagBits::eDeviceLocal,
-            "Lights SSBO",
-            vma_allocator
-        );
-    }
-
-
-    // CAMERA RESOURCES SETUP
-    ubo_camera_mapped.clear();
-    ubo_camera_mapped.resize(queue_pool.max_frames_in_flight);
-    vk::DeviceSize camera_buffer_size = sizeof(UniformBufferCamera);
-
-    for(size_t i = 0; i < queue_pool.max_frames_in_flight; i++){
-        ubo_camera_mapped[i].buffer = Device::createBuffer(
-            camera_buffer_size,
-            vk::BufferUsageFlagBits::eUniformBuffer,
-            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
-            "Camera Buffer",
-            vma_allocator
-        );
-        vmaMapMemory(vma_allocator, ubo_camera_mapped[i].buffer.allocation, &ubo_camera_mapped[i].data);
+    light_ssbo.resize(2);
+    active_slot = 0;
+    level_transition = LevelTransition::Idle;
+    upload_value = 0;
+
+    MengerLevel first_level;
+    first_level.cube_positions = cube_positions;
+    first_level.menger_step = current_menger_step;
+    first_level.cubes = current_cubes;
+    first_level.cube_size = cube_size;
+    first_level.upload_lights = true; // the shader always reads the light count, so the buffer is never empty
+    createLevelBuffers(active_slot, first_level);
+    writeLevelData(active_slot, first_level);
+    std::cout << "Menger level buffers: " << (first_level.direct_write ? "written in place (device local, host visible memory)" : "uploaded through staging buffers") << std::endl;
+
+    if(!first_level.direct_write){
+        vk::raii::CommandBuffer upload_command = Device::beginSingleTimeCommands(queue_pool.transfer_command_pool, logical_device);
+        recordLevelUpload(upload_command, active_slot, first_level);
+        Device::endSingleTimeCommands(upload_command, queue_pool.transfer_queue);
+        if(queue_pool.transfer_family != queue_pool.graphics_family){
+            pending_acquires = {cube_ssbo[active_slot].buffer.buffer, light_ssbo[active_slot].buffer.buffer};
+        }
     }
 
+    // Camera and main cube transforms are pushed with the draw, the scene needs no uniform buffer
     camera = Camera(glm::vec3(0, 0, 2), 0.1f);
 
 
 
-    const std::string vertex_shader_path = "Shaders/Menger/vertex.vert.spv";
-    const std::string fragment_shader_path = "Shaders/Menger/fragment.frag.spv";
-
-    std::vector<vk::DescriptorSetLayoutBinding> bindings = {
-        // Binding 0: Camera Uniform Buffer
-        vk::DescriptorSetLayoutBinding(
-            0, // binding location
-            vk::DescriptorType::eUniformBuffer, // Type of binding
-            1, // binding count
-            vk::ShaderStageFlagBits::eVertex,
-            nullptr
-        ),
-
-        // Binding 1: Cubes SSBO
-        vk::DescriptorSetLayoutBinding(
-            1,
-            vk::DescriptorType::eStorageBuffer,
-            1,
-            vk::ShaderStageFlagBits::eVertex,
-            nullptr
-        ),
-
-        // Binding 2: main cube uniform buffer
-        vk::DescriptorSetLayoutBinding(
-            2,
-            vk::DescriptorType::eUniformBuffer,
-            1,
-            vk::ShaderStageFlagBits::eVertex,
-            nullptr
-        ),
-
-        // Binding 3: Pointlights SSBO
-        vk::DescriptorSetLayoutBinding(
-            3,
-            vk::DescriptorType::eStorageBuffer,
-            1,
-            vk::ShaderStageFlagBits::eFragment,
-            nullptr
-        ),
-
-    };
-    std::string name = "dumb pipeline";
-    raster_pipelines.push_back(Pipeline::createsRasterPipeline(vertex_shader_path, fragment_shader_path,
-                                                    &bindings, vk::CullModeFlagBits::eBack, swapchain.format, 
-                                                    Image::findDepthFormat(physical_device), msaa_samples, 
-                                                    name, nullptr, logical_device
-                                                    ));
-    
-    raster_pipelines[0].descriptor_pool = Pipeline::createDescriptorPool(bindings, logical_device, queue_pool.max_frames_in_flight);
-    raster_pipelines[0].descriptor_sets = Pipeline::createDescriptorSets(raster_pipelines[0].descriptor_set_layout,
-                                                                        raster_pipelines[0].descriptor_pool,
-                                                                        logical_device,
-                                                                        queue_pool.max_frames_in_flight);
-    std::vector<void *> resources{
-        &ubo_camera_mapped,
-        &cube_ssbo,
-        &single_cube_ubo,
-        &light_ssbo
-    };
-    Pipeline::writeDescriptorSets(raster_pipelines[0].descriptor_sets, bindings, resources, logical_device, queue_pool.max_frames_in_flight);
+    // pip_to_obj and the shader reloads keep pointers to the bundles, the vector must not reallocate
+    raster_pipelines.reserve(MENGER_VARIANTS);
+    for(std::future<RasterPipelineBundle> &variant_build : variant_builds){
+        raster_pipelines.push_back(variant_build.get());
+    }
     
-    pip_to_obj[&raster_pipelines[0]] = std::vector<Gameobject*>();
-    pip_to_obj[&raster_pipelines[0]].push_back(&main_cube);
+    active_variant = UINT32_MAX;
+    selectMengerVariant();
 }
 
-void Scene::updateUniformBuffers(float dtime, int current_frame)
+uint32_t Scene::variantIndex(bool lit, bool rotation, bool procedural)
 {
-    UniformBufferCamera ubo_camera;
-
-    ubo_camera.view = camera.getViewMatrix();
-    ubo_camera.proj = camera.getProjectionMatrix(swapchain.extent.width * 1.f / swapchain.extent.height, n_plane, f_plane);
-
-    memcpy(ubo_camera_mapped[current_frame].data, &ubo_camera, sizeof(UniformBufferCamera));
-
-    FirstCubeBuffer first_cube;
-    main_cube.update(dtime);
-    first_cube.rotation_matrix = main_cube.getRotationMatrix();
-    first_cube.center_and_scale = glm::vec4(main_cube.getCenterVector(), main_cube.getScaleFactor());
-
-    memcpy(single_cube_ubo[current_frame].data, &first_cube, sizeof(FirstCubeBuffer));
-
-    if(dirty_positions < queue_pool.max_frames_in_flight){
-        // Writing cubes
-        dirty_positions++;
-        if(positions.size() < current_cubes){
-            positions.resize(current_cubes);
-        }
-        positions[0] = glm::vec4(cube_positions[0] - center, 1.0f);
-        size_t i = 1;
-        for(; i < current_cubes; i++){
-            positions[i] = glm::vec4(cube_positions[i] - center, 1.0f);
-        }
+    return (lit ? 4 : 0) + (rotation ? 2 : 0) + (procedural ? 1 : 0);
+}
 
-        memcpy(cube_ssbo_mapped[current_frame].data, positions.data(), current_cubes * sizeof(glm::vec4));
+RasterPipelineRequest Scene::makeVariantRequest(uint32_t variant)
+{
+    const bool lit = variant & 4;
+    const bool rotation = variant & 2;
+    const bool procedural = variant & 1;
+
+    RasterPipelineRequest request;
+    request.name = std::string("menger ") + (lit ? "lit" : "ambient") + (rotation ? " rotating" : " static") + (procedural ? " procedural" : " ssbo");
+    request.v_shader_path = "Shaders/Menger/vertex.vert.spv";
+    request.f_shader_path = "Shaders/Menger/fragment.frag.spv";
+    request.vertex_format = VertexFormat::Compact;
+    // Everything the shaders read is pushed, the heap layout only avoids an empty set of its own
+    request.shared_set_layout = *descriptor_heap.getLayout();
+    request.cull_mode = vk::CullModeFlagBits::eBack;
+    request.color_format = swapchain.format;
+    request.depth_format = Image::findDepthFormat(physical_device);
+    request.msaa_samples = msaa_samples;
+    request.push_constant_ranges = {vk::PushConstantRange(vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment, 0, sizeof(MengerPushConstants))};
+
+    request.specialization.set(static_cast<uint32_t>(MengerConstant::ROTATION), static_cast<vk::Bool32>(rotation));
+    request.specialization.set(static_cast<uint32_t>(MengerConstant::PROCEDURAL_INSTANCING), static_cast<vk::Bool32>(procedural));
+    request.specialization.set(static_cast<uint32_t>(MengerConstant::LIGHTING_MODEL), static_cast<int32_t>(lit ? 1 : 0));
+    request.specialization.set(static_cast<uint32_t>(MengerConstant::MAX_FRAGMENT_LIGHTS), max_fragment_lights);
+    request.specialization.set(static_cast<uint32_t>(MengerConstant::AMBIENT), ambient_light);
+
+    return request;
+}
 
-        Device::copyBuffer(cube_ssbo_mapped[current_frame].buffer, cube_ssbo[current_frame].buffer, current_cubes * sizeof(glm::vec4), logical_device, queue_pool, 0);
+void Scene::selectMengerVariant()
+{
+    // A level without lights or a cube that never rotated don't need those paths
+    bool lit = lights_enabled && current_pointlights > 0;
+    bool rotation = main_cube.getRotationVector() != glm::vec3(0.0f);
+    uint32_t variant = variantIndex(lit, rotation, procedural_instancing);
+    if(variant == active_variant){
+        return;
+    }
 
-        // Writing lights
-        if(pointlight_buffers.size() < current_pointlights){
-            pointlight_buffers.resize(current_pointlights);
-        }
+    if(active_variant < raster_pipelines.size()){
+        pip_to_obj.erase(&raster_pipelines[active_variant]);
+    }
+    pip_to_obj[&raster_pipelines[variant]] = {&main_cube};
+    active_variant = variant;
+    std::cout << "Drawing with pipeline variant: " << raster_pipelines[variant].pipeline_name << std::endl;
+}
 
-        if(current_pointlights > 0 && current_menger_step < 5){
-            for(i = 0; i < current_pointlights; i++){
-                PointLightBuffer buf;
-                buf.color = glm::vec4(light_colors[centers_and_levels[i].w], base_light_intensity / (centers_and_levels[i].w > 0 ? std::pow(intensity_divisor, centers_and_levels[i].w) : 1));
-                buf.position = glm::vec4(glm::vec3(centers_and_levels[i]), buf.color.w / light_threshold);
+void Scene::updateObjects(float dtime)
+{
+    main_cube.update(dtime);
+}
 
-                pointlight_buffers[i] = buf;
-            }
+void Scene::prepareFrame(float dtime)
+{
+    // Premultiplied, the shader only needs the product
+    frame_constants.view_proj = camera.getProjectionMatrix(swapchain.extent.width * 1.f / swapchain.extent.height, n_plane, f_plane) * camera.getViewMatrix();
+    // A quaternion takes a third of the push constant space of the rotation matrix
+    glm::quat rotation = glm::quat_cast(glm::mat3(main_cube.getRotationMatrix()));
+    frame_constants.rotation = glm::vec4(rotation.x, rotation.y, rotation.z, rotation.w);
+    frame_constants.center_and_scale = glm::vec4(main_cube.getCenterVector(), main_cube.getScaleFactor());
+}
 
-            glm::vec4 num(current_pointlights, 0, 0, 0);
-            memcpy(light_ssbo_mapped[current_frame].data, &num, sizeof(glm::vec4));
-            memcpy(static_cast<char*>(light_ssbo_mapped[current_frame].data) + sizeof(glm::vec4), pointlight_buffers.data(), current_pointlights * sizeof(PointLightBuffer));
+glm::mat4 Scene::getViewProjection()
+{
+    return frame_constants.view_proj;
+}
 
-            Device::copyBuffer(light_ssbo_mapped[current_frame].buffer, light_ssbo[current_frame].buffer, sizeof(glm::vec4) + current_pointlights * sizeof(PointLightBuffer), logical_device, queue_pool, 0);
-        }
-    }
+void Scene::updateUniformBuffers(int current_frame)
+{
+    // Nothing is copied: the frame constants are pushed while recording
+    updateLevelTransition();
+    selectMengerVariant();
+
+    // Written after the transition so that they always match the instances drawn this frame
+    frame_constants.cubes = cube_ssbo[active_slot].buffer.address;
+    frame_constants.lights = light_ssbo[active_slot].buffer.address;
+    frame_constants.menger_size = original_size;
+    frame_constants.menger_steps = current_menger_step - 1;
 }
 
 void Scene::recordCommandBuffer(uint32_t image_index)
@@ -254,6 +180,8 @@ void Scene::recordCommandBuffer(uint32_t image_index)
         command_buffer
     );
 
+    recordLevelAcquire(command_buffer);
+
     vk::ClearValue  clear_color = vk::ClearColorValue(0.0f, 0.0f, 0.0f, 1.0f);
 
     vk::RenderingAttachmentInfo attachment_info{};
@@ -273,6 +201,7 @@ void Scene::recordCommandBuffer(uint32_t image_index)
     depth_attachment_info.clearValue = depth_clear_value;
 
     vk::RenderingInfo rendering_info{};
+    rendering_info.flags = vk::RenderingFlagBits::eContentsSecondaryCommandBuffers; // Draws are recorded in secondary buffers
     rendering_info.renderArea.offset = vk::Offset2D{0, 0};
     rendering_info.renderArea.extent = swapchain.extent;
     rendering_info.layerCount = 1;
@@ -280,26 +209,17 @@ void Scene::recordCommandBuffer(uint32_t image_index)
     rendering_info.pColorAttachments = &attachment_info;
     rendering_info.pDepthAttachment = &depth_attachment_info;
 
+    vk::CommandBufferInheritanceRenderingInfo rendering_inheritance{};
+    rendering_inheritance.colorAttachmentCount = 1;
+    rendering_inheritance.pColorAttachmentFormats = &swapchain.format;
+    rendering_inheritance.depthAttachmentFormat = depth_image.image_format;
+    rendering_inheritance.rasterizationSamples = msaa_samples;
+
     command_buffer.beginRendering(rendering_info);
     if(raster_pipelines.size() <= 0){
         throw std::runtime_error("There are no raster pipelines that can be used!");
     }
-    command_buffer.setViewport(0, vk::Viewport(0.0f, 0.0f, static_cast<float>(swapchain.extent.width), static_cast<float>(swapchain.extent.height), 0.0f, 1.0f)); // What portion of the window to use
-    command_buffer.setScissor(0, vk::Rect2D(vk::Offset2D(0, 0), swapchain.extent)); // What portion of the image to use
-    for(size_t i = 0; i < raster_pipelines.size(); i++){
-        command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, *(raster_pipelines[i].pipeline));
-        command_buffer.setCullMode(raster_pipelines[i].cull_mode);
-        command_buffer.bindDescriptorSets(
-            vk::PipelineBindPoint::eGraphics,
-            raster_pipelines[i].layout,
-            0,
-            *raster_pipelines[i].descriptor_sets[current_frame],
-            {}
-        );
-        command_buffer.bindVertexBuffers(0, pip_to_obj[&raster_pipelines[i]][0] -> getVertexBuffer(), {0});
-        command_buffer.bindIndexBuffer(pip_to_obj[&raster_pipelines[i]][0] -> getIndexBuffer(), 0, vk::IndexType::eUint32);
-        command_buffer.drawIndexed(pip_to_obj[&raster_pipelines[i]][0] -> getIndexSize(), current_cubes, 0, 0, 0);
-    }
+    recordPipelines(command_buffer, rendering_inheritance);
     command_buffer.endRendering();
 
     // After rendering, transition the swapchain image to PRESENT_SRC
@@ -316,16 +236,38 @@ void Scene::recordCommandBuffer(uint32_t image_index)
     );
     command_buffer.end();
 
-    glfwSetWindowTitle(window, std::to_string(1000.0/time).c_str());
+    glfwSetWindowTitle(window, (std::to_string(1000.0/time) + getLevelStatus()).c_str());
 
 }
 
+void Scene::recordPipelineCommands(vk::raii::CommandBuffer &command_buffer, RasterPipelineBundle &pipeline)
+{
+    const std::vector<Gameobject *> &pipeline_objects = pip_to_obj.at(&pipeline);
+
+    command_buffer.bindPipeline(vk::PipelineBindPoint::eGraphics, *(pipeline.pipeline));
+    command_buffer.setCullMode(pipeline.cull_mode);
+    // No descriptor is read: camera, transforms and level buffer addresses are all in the push constants
+    command_buffer.pushConstants<MengerPushConstants>(pipeline.layout, vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment, 0, frame_constants);
+    const MeshAllocation &mesh = pipeline_objects[0] -> getMesh();
+    mesh_pool.bind(command_buffer, mesh.format);
+    command_buffer.drawIndexed(mesh.index_count, current_cubes, mesh.first_index, static_cast<int32_t>(mesh.first_vertex), 0);
+}
+
 void Scene::processInput()
 {
     if(inputs.count(GLFW_KEY_SPACE) && inputs[GLFW_KEY_SPACE] == InputState::PRESSED){
         mengerStep();
         inputs[GLFW_KEY_SPACE] = InputState::RELEASED;
     }
+    // The variant is switched by the render thread in updateUniformBuffers
+    if(inputs.count(GLFW_KEY_L) && inputs[GLFW_KEY_L] == InputState::PRESSED){
+        lights_enabled = !lights_enabled;
+        inputs[GLFW_KEY_L] = InputState::RELEASED;
+    }
+    if(inputs.count(GLFW_KEY_P) && inputs[GLFW_KEY_P] == InputState::PRESSED){
+        procedural_instancing = !procedural_instancing;
+        inputs[GLFW_KEY_P] = InputState::RELEASED;
+    }
 
     if(inputs.count(GLFW_KEY_W) && (inputs[GLFW_KEY_W] == InputState::PRESSED || inputs[GLFW_KEY_W] == InputState::HOLD)){
         camera.processKeyboard(CameraMovement::FORWARD, time);
@@ -343,26 +285,57 @@ void Scene::processInput()
 
 void Scene::mengerStep()
 {
-    dirty_positions = 0;
+    if(level_transition != LevelTransition::Idle){
+        std::cout << "Still loading step " << current_menger_step + 1 << ", wait for it to complete" << std::endl;
+        return;
+    }
+
+    uint32_t new_cube_tot = std::pow(20, current_menger_step);
+    if(new_cube_tot > MAX_CUBES){
+        std::cout << "Reached the maximum number of cubes (" << MAX_CUBES << "), can't go further" << std::endl;
+        return;
+    }
+
+    // The subdivision runs on the background thread, outside of the frame workers, the current level keeps rendering meanwhile
+    level_progress.store(0.f, std::memory_order_relaxed);
+    level_transition = LevelTransition::Generating;
+    uint32_t pending_slot = 1 - active_slot;
+    menger_job = background_jobs.schedule([this, pending_slot](uint32_t){
+        generateMengerLevel(pending_slot);
+    });
+}
+
+void Scene::generateMengerLevel(uint32_t slot)
+{
+    // Only reads the current level, which is not modified until applyMengerLevel runs after this job completed
+    MengerLevel &level = next_level;
+    level.menger_step = current_menger_step + 1;
+    level.cube_size = cube_size / 3.0;
+    level.pointlights = current_pointlights;
+    level.upload_lights = level.menger_step < 5;
+
     uint32_t dimension_step = std::pow(3, current_menger_step);
-    cube_size /= 3.0;
     uint32_t new_cube_tot = std::pow(20, current_menger_step);
-    current_menger_step += 1;
-    float cube_size_dim = cube_size - cube_size * 0.05;
+    double size = level.cube_size;
 
-    std::cout << "Step: " << current_menger_step
+    std::cout << "Step: " << level.menger_step
               << " | Grid: " << dimension_step << "x" << dimension_step 
               << " | Total cubes: " << new_cube_tot
-              << " | Cube Size: " << cube_size << std::endl;
+              << " | Cube Size: " << size << std::endl;
 
-    double start_offset = -(original_size / 2) + (cube_size / 2.0);
-    
     uint32_t index = 0;
 
-    std::copy_n(cube_positions.begin(), current_cubes, temp_positions.begin());
+    // Containers are sized exactly for the new level
+    level.cube_positions.resize(new_cube_tot);
+    level.centers_and_levels.resize(current_pointlights + current_cubes); // One light at the center of every subdivided cube
+    std::copy_n(centers_and_levels.begin(), current_pointlights, level.centers_and_levels.begin());
 
     for(size_t cube_ind = 0; cube_ind < current_cubes; cube_ind++){
-        glm::vec3 &pos = temp_positions[cube_ind];
+        if(cube_ind % 4096 == 0){
+            level_progress.store(cube_ind * 1.f / current_cubes, std::memory_order_relaxed);
+        }
+
+        const glm::vec3 &pos = cube_positions[cube_ind];
         for(size_t i = 0; i < 3; i++){ // x dimension
             for(size_t j = 0; j < 3; j++){ // y dimension
                 for(size_t k = 0; k < 3; k++){ // z dimension
@@ -371,25 +344,25 @@ void Scene::mengerStep()
                         (i == 1 && k == 1) || 
                         (j == 1 && k == 1)){
                         if(i == 1 && j == 1 && k == 1){
-                            centers_and_levels[current_pointlights] = glm::vec4(
-                                pos.x + i * cube_size - cube_size,
-                                pos.y + j * cube_size - cube_size,
-                                pos.z + k * cube_size - cube_size,
-                                current_menger_step - 2 // This is needed to extract the correct color for the light
+                            level.centers_and_levels[level.pointlights] = glm::vec4(
+                                pos.x + i * size - size,
+                                pos.y + j * size - size,
+                                pos.z + k * size - size,
+                                level.menger_step - 2 // This is needed to extract the correct color for the light
                             );
-                            current_pointlights++;
+                            level.pointlights++;
                         }
 
                         continue;
                     }
 
                     glm::vec3 new_pos(
-                        pos.x + i * cube_size - cube_size,
-                        pos.y + j * cube_size - cube_size,
-                        pos.z + k * cube_size - cube_size
+                        pos.x + i * size - size,
+                        pos.y + j * size - size,
+                        pos.z + k * size - size
                     );
 
-                    cube_positions[index] = new_pos;
+                    level.cube_positions[index] = new_pos;
                     index++;
                 }
             }
@@ -400,18 +373,235 @@ void Scene::mengerStep()
     if(index != new_cube_tot){
         std::cout << "ERROR! calculated cubes: " << new_cube_tot << " Actual cubes: " << index << std::endl;
     }
+    level.cubes = index;
+    level_progress.store(1.f, std::memory_order_relaxed);
+
+    // Buffers are created and written here too, so the render thread at most has to submit the copy
+    createLevelBuffers(slot, level);
+    writeLevelData(slot, level);
+}
+
+void Scene::updateLevelTransition()
+{
+    if(level_transition == LevelTransition::Generating && JobSystem::isDone(menger_job)){
+        JobSystem::wait(menger_job); // Rethrows if the generation failed
+        menger_job.reset();
+
+        // Levels written in place are visible to the next submission, only the staged ones need a copy
+        if(!next_level.direct_write){
+            // Submitted from the render thread, the transfer queue may be the graphics one
+            upload_command_buffer = Device::beginSingleTimeCommands(queue_pool.transfer_command_pool, logical_device);
+            recordLevelUpload(upload_command_buffer, 1 - active_slot, next_level);
+            upload_command_buffer.end();
+
+            upload_value = Sync::nextValue(queue_pool.transfer_timeline);
+            vk::SemaphoreSubmitInfo signal_info = Sync::submitInfo(queue_pool.transfer_timeline, upload_value, vk::PipelineStageFlagBits2::eAllTransfer);
+            vk::CommandBufferSubmitInfo command_buffer_info(*upload_command_buffer);
+            vk::SubmitInfo2 submit_info;
+            submit_info.commandBufferInfoCount = 1;
+            submit_info.pCommandBufferInfos = &command_buffer_info;
+            submit_info.signalSemaphoreInfoCount = 1;
+            submit_info.pSignalSemaphoreInfos = &signal_info;
+            queue_pool.transfer_queue.submit2(submit_info);
+        }
+
+        // No need to wait for the copy on the CPU: the level is swapped in now and the frames wait for it on the GPU
+        applyMengerLevel();
+    }
+
+    // Every frame recorded before the upload completes waits for it, a semaphore wait only covers its own submission
+    if(!Sync::isComplete(queue_pool.transfer_timeline, upload_value)){
+        waitBeforeGraphics(queue_pool.transfer_timeline, upload_value, vk::PipelineStageFlagBits2::eVertexShader | vk::PipelineStageFlagBits2::eFragmentShader);
+    }
+}
+
+void Scene::applyMengerLevel()
+{
+    uint32_t pending_slot = 1 - active_slot;
+
+    // Later levels don't upload lights, the previous buffer simply moves to the new slot
+    if(!next_level.upload_lights){
+        light_ssbo[pending_slot] = std::move(light_ssbo[active_slot]);
+    }
+
+    // Frames still in flight may use the previous level, its buffers are released once this frame completes
+    retireResource(cube_ssbo[active_slot]);
+    retireResource(light_ssbo[active_slot]);
+    active_slot = pending_slot;
+
+    // Buffers written by the host were never owned by the transfer family
+    if(!next_level.direct_write && queue_pool.transfer_family != queue_pool.graphics_family){
+        pending_acquires.push_back(cube_ssbo[active_slot].buffer.buffer);
+        if(next_level.upload_lights){
+            pending_acquires.push_back(light_ssbo[active_slot].buffer.buffer);
+        }
+    }
+
+    cube_positions.swap(next_level.cube_positions);
+    centers_and_levels.swap(next_level.centers_and_levels);
+    current_menger_step = next_level.menger_step;
+    current_cubes = next_level.cubes;
+    current_pointlights = next_level.pointlights;
+    cube_size = next_level.cube_size;
+
+    // Staging and command buffer are released once this frame, which waits for the upload, completes
+    retireResource(next_level.staging);
+    retireResource(upload_command_buffer);
+    next_level = MengerLevel();
+    level_transition = LevelTransition::Idle;
+
+    float cube_size_dim = cube_size - cube_size * 0.05;
+    double start_offset = -(original_size / 2) + (cube_size / 2.0);
     main_cube.modifyCube(glm::vec3(start_offset, start_offset, -5.5 - (cube_size/2.0)), glm::vec3(cube_size_dim));
-    current_cubes = index;
+
+    reportMemory("menger step " + std::to_string(current_menger_step));
+}
+
+void Scene::createLevelBuffers(uint32_t slot, MengerLevel &level)
+{
+    cube_ssbo[slot].buffer = Device::createDirectWriteBuffer(
+        sizeof(glm::vec4) * level.cubes,
+        vk::BufferUsageFlagBits::eShaderDeviceAddress,
+        "Gameobject SSBO",
+        vma_allocator
+    );
+    cube_ssbo[slot].data = cube_ssbo[slot].buffer.info.pMappedData;
+    level.direct_write = cube_ssbo[slot].data != nullptr;
+
+    if(level.upload_lights){
+        light_ssbo[slot].buffer = Device::createDirectWriteBuffer(
+            sizeof(glm::vec4) + sizeof(PointLightBuffer) * std::max(level.pointlights, 1u),
+            vk::BufferUsageFlagBits::eShaderDeviceAddress,
+            "Lights SSBO",
+            vma_allocator
+        );
+        light_ssbo[slot].data = light_ssbo[slot].buffer.info.pMappedData;
+        // Both buffers go through the same path, a partially host visible level is staged entirely
+        level.direct_write = level.direct_write && light_ssbo[slot].data != nullptr;
+    }
+}
+
+void Scene::writeLevelData(uint32_t slot, MengerLevel &level)
+{
+    vk::DeviceSize cubes_size = sizeof(glm::vec4) * level.cubes;
+    vk::DeviceSize lights_size = level.upload_lights ? sizeof(glm::vec4) + sizeof(PointLightBuffer) * level.pointlights : 0;
+
+    char *cubes_data = nullptr;
+    char *lights_data = nullptr;
+    if(level.direct_write){
+        cubes_data = static_cast<char*>(cube_ssbo[slot].data);
+        lights_data = static_cast<char*>(light_ssbo[slot].data);
+    }
+    else{
+        level.staging.buffer = Device::createBuffer(
+            cubes_size + lights_size,
+            vk::BufferUsageFlagBits::eTransferSrc,
+            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+            "Level staging",
+            vma_allocator,
+            MemoryClass::Staging
+        );
+        level.staging.data = level.staging.buffer.info.pMappedData;
+        cubes_data = static_cast<char*>(level.staging.data);
+        lights_data = cubes_data + cubes_size;
+    }
+
+    // Writing cubes, sequentially: direct writes go through write combined memory, which must never be read back
+    glm::vec4 *positions = reinterpret_cast<glm::vec4*>(cubes_data);
+    for(size_t i = 0; i < level.cubes; i++){
+        positions[i] = glm::vec4(level.cube_positions[i] - center, 1.0f);
+    }
+
+    // Writing lights
+    if(level.upload_lights){
+        char *lights = lights_data;
+        glm::vec4 num(level.pointlights, 0, 0, 0);
+        memcpy(lights, &num, sizeof(glm::vec4));
+
+        PointLightBuffer *pointlight_buffers = reinterpret_cast<PointLightBuffer*>(lights + sizeof(glm::vec4));
+        for(size_t i = 0; i < level.pointlights; i++){
+            const glm::vec4 &center_and_level = level.centers_and_levels[i];
+            PointLightBuffer buf;
+            buf.color = glm::vec4(light_colors[center_and_level.w], base_light_intensity / (center_and_level.w > 0 ? std::pow(intensity_divisor, center_and_level.w) : 1));
+            buf.position = glm::vec4(glm::vec3(center_and_level), buf.color.w / light_threshold);
+
+            pointlight_buffers[i] = buf;
+        }
+    }
+
+    if(level.direct_write){
+        Device::flushBuffer(cube_ssbo[slot].buffer);
+        if(level.upload_lights){
+            Device::flushBuffer(light_ssbo[slot].buffer);
+        }
+    }
+}
+
+void Scene::recordLevelUpload(vk::raii::CommandBuffer &command_buffer, uint32_t slot, const MengerLevel &level)
+{
+    vk::DeviceSize cubes_size = sizeof(glm::vec4) * level.cubes;
+    command_buffer.copyBuffer(level.staging.buffer.buffer, cube_ssbo[slot].buffer.buffer, vk::BufferCopy(0, 0, cubes_size));
+    if(level.upload_lights){
+        vk::DeviceSize lights_size = sizeof(glm::vec4) + sizeof(PointLightBuffer) * level.pointlights;
+        command_buffer.copyBuffer(level.staging.buffer.buffer, light_ssbo[slot].buffer.buffer, vk::BufferCopy(cubes_size, 0, lights_size));
+    }
+
+    // Exclusive buffers written by a dedicated transfer family must be released to the graphics one
+    if(queue_pool.transfer_family != queue_pool.graphics_family){
+        Device::bufferBarrier(cube_ssbo[slot].buffer.buffer, vk::AccessFlagBits2::eTransferWrite, {}, vk::PipelineStageFlagBits2::eTransfer, {},
+                              queue_pool.transfer_family.value(), queue_pool.graphics_family.value(), command_buffer);
+        if(level.upload_lights){
+            Device::bufferBarrier(light_ssbo[slot].buffer.buffer, vk::AccessFlagBits2::eTransferWrite, {}, vk::PipelineStageFlagBits2::eTransfer, {},
+                                  queue_pool.transfer_family.value(), queue_pool.graphics_family.value(), command_buffer);
+        }
+    }
+}
+
+void Scene::recordLevelAcquire(vk::raii::CommandBuffer &command_buffer)
+{
+    // The source stages are the ones waiting on the transfer timeline (see updateLevelTransition), which chains the
+    // acquire after the semaphore wait
+    const vk::PipelineStageFlags2 shader_stages = vk::PipelineStageFlagBits2::eVertexShader | vk::PipelineStageFlagBits2::eFragmentShader;
+    for(vk::Buffer buffer : pending_acquires){
+        Device::bufferBarrier(buffer, {}, vk::AccessFlagBits2::eShaderStorageRead, shader_stages, shader_stages,
+                              queue_pool.transfer_family.value(), queue_pool.graphics_family.value(), command_buffer);
+    }
+    pending_acquires.clear();
+}
+
+std::string Scene::getLevelStatus()
+{
+    switch(level_transition){
+        case LevelTransition::Generating:
+            return " | Step " + std::to_string(current_menger_step + 1) + ": generating " + std::to_string(static_cast<int>(level_progress.load(std::memory_order_relaxed) * 100)) + "%";
+        default:
+            return "";
+    }
+}
+
+void Scene::reportMemory(const std::string &label)
+{
+    // The CPU side containers are the biggest host allocations of the scene, report them next to the Vulkan heaps
+    std::vector<std::pair<std::string, size_t>> cpu_allocations = {
+        {"cube_positions", cube_positions.capacity() * sizeof(glm::vec3)},
+        {"centers_and_levels", centers_and_levels.capacity() * sizeof(glm::vec4)},
+        {"next_level", next_level.cube_positions.capacity() * sizeof(glm::vec3) + next_level.centers_and_levels.capacity() * sizeof(glm::vec4)}
+    };
+
+    MemoryAllocator::printMemoryReport(vma_allocator, label, cpu_allocations);
+    MemoryAllocator::dumpMemoryReport(vma_allocator, label, memory_report_path, !memory_report_started, cpu_allocations);
+    memory_report_started = true;
 }
 
 
 void Scene::cleanup(){
+    JobSystem::wait(menger_job);
+    background_jobs.stop();
     main_cube = Cube();
-    single_cube_ubo.clear();
-    cube_ssbo_mapped.clear();
     cube_ssbo.clear();
-    light_ssbo_mapped.clear();
     light_ssbo.clear();
+    next_level = MengerLevel();
+    upload_command_buffer = nullptr;
 
     Engine::cleanup();
 }
\ No newline at end of file
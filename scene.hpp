@@ -7,9 +7,26 @@ struct CubeBuffer{
     glm::vec4 position;
 };
 
-struct FirstCubeBuffer{
-    glm::mat4 rotation_matrix;
+// Push constants of the menger pipeline: everything it reads per frame, within the 128 bytes every device supports
+struct MengerPushConstants{
+    glm::mat4 view_proj;
+    glm::vec4 rotation; // Quaternion (x, y, z, w) of the main cube
     glm::vec4 center_and_scale;
+    vk::DeviceAddress cubes; // Buffers of the active level
+    vk::DeviceAddress lights;
+    float menger_size; // Size of the cube before any subdivision, used by procedural instancing
+    uint32_t menger_steps; // Subdivisions of the active level
+    uint32_t base_color; // RGBA8 color of every cube, the compact vertices don't store it
+};
+static_assert(sizeof(MengerPushConstants) <= 128, "Push constants beyond 128 bytes are not guaranteed");
+
+// Specialization constant ids of the menger shaders
+enum class MengerConstant : uint32_t{
+    ROTATION = 0,
+    PROCEDURAL_INSTANCING = 1,
+    LIGHTING_MODEL = 2,
+    MAX_FRAGMENT_LIGHTS = 3,
+    AMBIENT = 4
 };
 
 struct PointLightBuffer{
@@ -17,6 +34,25 @@ struct PointLightBuffer{
     glm::vec4 color; // last value will be intensity
 };
 
+// Result of a menger subdivision, computed in the background together with the staging copy of its GPU data
+struct MengerLevel{
+    std::vector<glm::vec3> cube_positions;
+    std::vector<glm::vec4> centers_and_levels;
+    uint32_t menger_step = 0;
+    uint32_t cubes = 0;
+    uint32_t pointlights = 0;
+    double cube_size = 0.0;
+    bool upload_lights = false; // Lights are only uploaded for the first levels, later ones keep the previous buffer
+    bool direct_write = false; // Its buffers are host visible and were written in place, there is nothing to upload
+    MappedUBO staging; // Cube positions followed by the lights header and the lights, only without direct writes
+};
+
+// State of the transition to the next menger level
+enum class LevelTransition{
+    Idle,
+    Generating // The job is computing the level and filling its buffers or their staging buffer
+};
+
 class Scene : public Engine {
 public:
 
@@ -35,24 +71,42 @@ private:
     glm::vec3 rot_speed = glm::vec3(0.05f, 0.05f, 0.0f);
     Cube main_cube;
     std::vector<glm::vec3> cube_positions;
-    std::vector<glm::vec3> temp_positions;
-    std::vector<MappedUBO> single_cube_ubo;
-    std::vector<glm::vec4> positions;
-    std::vector<MappedUBO> cube_ssbo_mapped;
-    std::vector<MappedUBO> cube_ssbo; // They are not actually mapped, I should fix it later but it is to make it work with writeDescriptor
-    uint8_t dirty_positions = 0;
+    std::vector<MappedUBO> cube_ssbo; // [level slot]. The shaders read it through its device address, mapped only with direct writes
+    MengerPushConstants frame_constants; // Part of the frame packet specific to the scene, pushed with every draw
+
+    // Level transitions: the next level is generated and uploaded into the pending slot while the active one keeps rendering
+    LevelTransition level_transition = LevelTransition::Idle;
+    JobHandle menger_job; // Background generation of the next level, null when idle
+    // Dedicated thread for the level generation: it lasts many frames and must never delay the frame jobs and the
+    // recording, which a shared worker (or no worker at all, with few cores) would do
+    JobSystem background_jobs;
+    MengerLevel next_level;
+    std::atomic<float> level_progress{0.f}; // Fraction of the generation completed, shown in the title bar
+    uint32_t active_slot = 0; // Its buffer addresses are pushed with every draw, swapping levels needs no descriptor update
+    vk::raii::CommandBuffer upload_command_buffer = nullptr;
+    uint64_t upload_value = 0; // Transfer timeline value signaled by the last level upload
+    std::vector<vk::Buffer> pending_acquires; // Uploaded buffers the graphics queue still has to acquire from the transfer family
+
+    // Shader variants: one pipeline per combination of lighting, rotation and instancing, all sharing the same layout.
+    // raster_pipelines[i] is the variant i, the first one also owns the descriptor sets
+    static constexpr uint32_t MENGER_VARIANTS = 8;
+    uint32_t active_variant = UINT32_MAX;
+    bool lights_enabled = true; // Toggled with L, the lights are also skipped while the level has none
+    bool procedural_instancing = false; // Toggled with P
+    // Upper bound of the lights shaded per fragment. Lower it to bound the shading cost of the deep levels, at the price of missing lights
+    int32_t max_fragment_lights = MAX_LIGHTS;
+    float ambient_light = 0.1f;
+
 
     // Variables related to camera
     float n_plane = 0.1f;
     float f_plane = 10000.f;
 
     // Variables related to light
-    const uint32_t MAX_LIGHTS = 3368421;
+    static constexpr uint32_t MAX_LIGHTS = 3368421;
     std::vector<glm::vec4> centers_and_levels;
     uint32_t current_pointlights = 0;
-    std::vector<MappedUBO> light_ssbo_mapped;
-    std::vector<MappedUBO> light_ssbo;
-    std::vector<PointLightBuffer> pointlight_buffers;
+    std::vector<MappedUBO> light_ssbo; // [level slot]
     float base_light_intensity = 100000.f;
     uint16_t intensity_divisor = 10;
     float light_threshold = 0.01;
@@ -66,10 +120,39 @@ private:
 
     // Virtual function from engine
     void createInitResources() override;
-    void updateUniformBuffers(float dtime, int current_frame) override;
+    void updateObjects(float dtime) override;
+    void prepareFrame(float dtime) override;
+    glm::mat4 getViewProjection() override;
+    void updateUniformBuffers(int current_frame) override;
     void recordCommandBuffer(uint32_t image_index) override;
+    void recordPipelineCommands(vk::raii::CommandBuffer &command_buffer, RasterPipelineBundle &pipeline) override;
     void processInput() override;
+    void reportMemory(const std::string &label) override;
+
+    // Variant index from its configuration, and the request building it
+    static uint32_t variantIndex(bool lit, bool rotation, bool procedural);
+    RasterPipelineRequest makeVariantRequest(uint32_t variant);
+    // Render thread: draws the main cube with the variant matching the current state of the scene
+    void selectMengerVariant();
 
-    // Function that splits and calculates new cubes
+    // Starts the background generation of the next menger level
     void mengerStep();
+    // Job that splits and calculates new cubes into next_level, then prepares its buffers for the pending slot
+    void generateMengerLevel(uint32_t slot);
+    // Render thread: submits the upload once the generation completed and swaps the level in
+    void updateLevelTransition();
+    // Makes the level being uploaded the active one, retiring the buffers of the previous one
+    void applyMengerLevel();
+
+    // Create the device local buffers of a level slot, sized for the level cubes/lights. They are written directly when
+    // the device has host visible device local memory for them, see MengerLevel::direct_write
+    void createLevelBuffers(uint32_t slot, MengerLevel &level);
+    // Fills the buffers of a slot in place, or a new staging buffer of the level when they are not host visible
+    void writeLevelData(uint32_t slot, MengerLevel &level);
+    // Records the copy from the staging buffer of a level into the buffers of a slot, releasing them to the graphics family if needed
+    void recordLevelUpload(vk::raii::CommandBuffer &command_buffer, uint32_t slot, const MengerLevel &level);
+    // Records the acquire half of the ownership transfer of freshly uploaded buffers
+    void recordLevelAcquire(vk::raii::CommandBuffer &command_buffer);
+    // Progress of the level transition for the title bar, empty when idle
+    std::string getLevelStatus();
 };
\ No newline at end of file